@@ -0,0 +1,209 @@
+// Shared benchmark harness of the examples: wall time, allocations and, where
+// perf counters are available, retired instructions of a measured region.
+// Every result is also appended as one JSON line to the file named by the
+// BENCH_JSON environment variable, tagged with BENCH_VARIANT, see
+// benchmark/build.ninja.
+//
+// Replaces the global operator new to count allocations, so include it from
+// exactly one translation unit per program, as the single file examples do.
+
+#ifndef BENCH_HPP
+#define BENCH_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include <string>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <cstring>
+#endif
+
+namespace bench {
+  inline std::atomic<std::size_t>& allocation_count() {
+    static std::atomic<std::size_t> count(0);
+    return count;
+  }
+}
+
+// Every replaceable form of new counts, std::pmr::new_delete_resource()
+// for instance allocates through the aligned ones. The plain forms are the
+// ones the others build on.
+// Kept out of line, or gcc sees malloc() and free() meet new and delete and
+// warns about a mismatch.
+__attribute__((noinline)) void* operator new(std::size_t n) {
+  bench::allocation_count().fetch_add(1, std::memory_order_relaxed);
+  if (void* p = std::malloc(n ? n : 1)) return p;
+  throw std::bad_alloc();
+}
+__attribute__((noinline)) void operator delete(void* p) noexcept { std::free(p); }
+__attribute__((noinline)) void operator delete(void* p, std::size_t) noexcept { std::free(p); }
+
+__attribute__((noinline)) void* operator new[](std::size_t n) { return operator new(n); }
+__attribute__((noinline)) void operator delete[](void* p) noexcept { operator delete(p); }
+__attribute__((noinline)) void operator delete[](void* p, std::size_t) noexcept { operator delete(p); }
+
+__attribute__((noinline)) void* operator new(std::size_t n, const std::nothrow_t&) noexcept {
+  try { return operator new(n); } catch (const std::bad_alloc&) { return nullptr; }
+}
+__attribute__((noinline)) void* operator new[](std::size_t n, const std::nothrow_t&) noexcept {
+  return operator new(n, std::nothrow);
+}
+__attribute__((noinline)) void operator delete(void* p, const std::nothrow_t&) noexcept { operator delete(p); }
+__attribute__((noinline)) void operator delete[](void* p, const std::nothrow_t&) noexcept { operator delete(p); }
+
+__attribute__((noinline)) void* operator new(std::size_t n, std::align_val_t alignment) {
+  bench::allocation_count().fetch_add(1, std::memory_order_relaxed);
+  std::size_t align = std::max(std::size_t(alignment), sizeof(void*));
+  // aligned_alloc wants a multiple of the alignment
+  std::size_t size = (std::max<std::size_t>(n, 1) + align - 1) / align * align;
+  if (void* p = std::aligned_alloc(align, size)) return p;
+  throw std::bad_alloc();
+}
+__attribute__((noinline)) void operator delete(void* p, std::align_val_t) noexcept { std::free(p); }
+__attribute__((noinline)) void operator delete(void* p, std::size_t, std::align_val_t) noexcept { std::free(p); }
+__attribute__((noinline)) void* operator new[](std::size_t n, std::align_val_t alignment) {
+  return operator new(n, alignment);
+}
+__attribute__((noinline)) void operator delete[](void* p, std::align_val_t) noexcept { std::free(p); }
+__attribute__((noinline)) void operator delete[](void* p, std::size_t, std::align_val_t) noexcept { std::free(p); }
+__attribute__((noinline)) void* operator new(std::size_t n, std::align_val_t alignment, const std::nothrow_t&) noexcept {
+  try { return operator new(n, alignment); } catch (const std::bad_alloc&) { return nullptr; }
+}
+__attribute__((noinline)) void* operator new[](std::size_t n, std::align_val_t alignment, const std::nothrow_t&) noexcept {
+  return operator new(n, alignment, std::nothrow);
+}
+__attribute__((noinline)) void operator delete(void* p, std::align_val_t, const std::nothrow_t&) noexcept { std::free(p); }
+__attribute__((noinline)) void operator delete[](void* p, std::align_val_t, const std::nothrow_t&) noexcept { std::free(p); }
+
+namespace bench {
+
+  /** global allocations so far */
+  inline std::size_t allocations() {
+    return allocation_count().load(std::memory_order_relaxed);
+  }
+
+  /**
+   * Instructions retired in user space by this thread and the threads it
+   * starts meanwhile, not by threads already running. Unavailable (-1)
+   * without perf events, e.g. in most containers.
+   */
+  class instruction_counter {
+  public:
+#ifdef __linux__
+    instruction_counter() {
+      perf_event_attr attr;
+      std::memset(&attr, 0, sizeof(attr));
+      attr.type = PERF_TYPE_HARDWARE;
+      attr.size = sizeof(attr);
+      attr.config = PERF_COUNT_HW_INSTRUCTIONS;
+      attr.disabled = 1;
+      attr.inherit = 1;
+      attr.exclude_kernel = 1;
+      attr.exclude_hv = 1;
+      _fd = int(syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0));
+    }
+    ~instruction_counter() {
+      if (_fd >= 0) close(_fd);
+    }
+    void start() {
+      if (_fd < 0) return;
+      ioctl(_fd, PERF_EVENT_IOC_RESET, 0);
+      ioctl(_fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+    long long stop() {
+      if (_fd < 0) return -1;
+      ioctl(_fd, PERF_EVENT_IOC_DISABLE, 0);
+      long long count = 0;
+      return read(_fd, &count, sizeof(count)) == sizeof(count) ? count : -1;
+    }
+#else
+    void start() {}
+    long long stop() { return -1; }
+#endif
+    instruction_counter(const instruction_counter&) = delete;
+    instruction_counter& operator=(const instruction_counter&) = delete;
+
+  private:
+#ifdef __linux__
+    int _fd;
+#endif
+  };
+
+  /** one measured region of ops operations */
+  struct result {
+    double ops;
+    double ns;
+    std::size_t allocations;
+    long long instructions;
+
+    double ns_per_op() const { return ns / ops; }
+    double allocs_per_op() const { return allocations / ops; }
+    /** negative if not counted */
+    double instructions_per_op() const { return instructions < 0 ? -1 : instructions / ops; }
+  };
+
+  /** runs f() once as ops operations */
+  template<typename F>
+  result measure(double ops, F f) {
+    instruction_counter instructions;
+    std::size_t allocated = allocations();
+    instructions.start();
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    f();
+    std::chrono::steady_clock::time_point stop = std::chrono::steady_clock::now();
+    result r;
+    r.instructions = instructions.stop();
+    r.allocations = allocations() - allocated;
+    r.ops = ops;
+    r.ns = std::chrono::duration<double, std::nano>(stop - start).count();
+    return r;
+  }
+
+  inline std::string json_string(const std::string& s) {
+    std::string quoted = "\"";
+    for (char c : s) {
+      if (c == '"' || c == '\\') quoted += '\\';
+      quoted += c;
+    }
+    return quoted + "\"";
+  }
+
+  /** appends r as JSON line to $BENCH_JSON, if set */
+  inline void record(const std::string& suite, const std::string& name, const result& r) {
+    const char* path = std::getenv("BENCH_JSON");
+    if (!path || !*path) return;
+    std::FILE* out = std::fopen(path, "a");
+    if (!out) return;
+    std::string::size_type first = name.find_first_not_of(' ');
+    std::string trimmed = first == std::string::npos
+        ? name : name.substr(first, name.find_last_not_of(' ') + 1 - first);
+    const char* variant = std::getenv("BENCH_VARIANT");
+    std::string instructions = r.instructions < 0 ? "null" : std::to_string(r.instructions_per_op());
+    std::fprintf(out,
+                 "{\"variant\": %s, \"suite\": %s, \"name\": %s, \"ops\": %.0f, "
+                 "\"ns_per_op\": %g, \"allocs_per_op\": %g, \"instructions_per_op\": %s}\n",
+                 json_string(variant ? variant : "default").c_str(), json_string(suite).c_str(),
+                 json_string(trimmed).c_str(), r.ops, r.ns_per_op(), r.allocs_per_op(),
+                 instructions.c_str());
+    std::fclose(out);
+  }
+
+  /** measure and record */
+  template<typename F>
+  result run(const std::string& suite, const std::string& name, double ops, F f) {
+    result r = measure(ops, f);
+    record(suite, name, r);
+    return r;
+  }
+}
+
+#endif // BENCH_HPP
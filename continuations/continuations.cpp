@@ -10,19 +10,715 @@
 #include <functional>
 #include <thread>
 #include <chrono>
+#include <memory>
+#include <vector>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <algorithm>
+#include <cstdlib>
+#include <new>
+#include <string>
+#include <optional>
+#include <coroutine>
+#include <exception>
+#include <type_traits>
+#include <future>
+#include <queue>
+#include <cstdint>
+#include <fstream>
+
+// counts allocations for the benchmarks
+#include "bench.hpp"
+
+/**
+ * Tracing
+ * Every stage of the pipeline (asyncApi, a Bind step, a LoopN iteration...)
+ * records enqueue/start/finish timestamps into a ring buffer owned by the
+ * recording thread, so recording takes no lock and never touches a stream.
+ * Queue wait (enqueue to start) and run time (start to finish) of each stage
+ * also go into HDR-style latency histograms. The buffers can be exported as
+ * Chrome trace JSON (chrome://tracing, ui.perfetto.dev).
+ *
+ * Build with -DCONTINUATIONS_TRACE=1 to enable. Otherwise every type below is
+ * empty and every function an inline no-op, recording compiles to nothing.
+ */
+#ifndef CONTINUATIONS_TRACE
+#define CONTINUATIONS_TRACE 0
+#endif
+
+namespace trace {
+
+constexpr bool enabled = CONTINUATIONS_TRACE;
+
+#if CONTINUATIONS_TRACE
+
+inline std::uint64_t now() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/**
+ * Log-linear histogram: 16 linear sub-buckets per power of two, i.e. a
+ * relative error below 1/16 over the whole range of values.
+ */
+class Histogram {
+public:
+  static const unsigned sub_bits = 4;
+  static const unsigned sub_count = 1u << sub_bits;
+  static const unsigned bucket_count = 64 * sub_count;
+
+  Histogram() : _max(0) {
+      for (auto& count : _counts) count = 0;
+  }
+  void record(std::uint64_t value) {
+      _counts[index(value)].fetch_add(1, std::memory_order_relaxed);
+      std::uint64_t max = _max.load(std::memory_order_relaxed);
+      while (value > max && !_max.compare_exchange_weak(max, value, std::memory_order_relaxed)) {
+      }
+  }
+  /** largest value recorded, exact unlike the percentiles */
+  std::uint64_t max() const {
+      return _max.load(std::memory_order_relaxed);
+  }
+  std::uint64_t count() const {
+      std::uint64_t n = 0;
+      for (auto& count : _counts) n += count.load(std::memory_order_relaxed);
+      return n;
+  }
+  /** lower bound of the bucket holding the given percentile */
+  std::uint64_t percentile(double p) const {
+      std::uint64_t total = count();
+      if (!total) return 0;
+      std::uint64_t rank = std::min(total - 1, std::uint64_t(p / 100.0 * double(total)));
+      std::uint64_t seen = 0;
+      for (unsigned i = 0; i < bucket_count; ++i) {
+          seen += _counts[i].load(std::memory_order_relaxed);
+          if (seen > rank) return lowest(i);
+      }
+      return lowest(bucket_count - 1);
+  }
+
+private:
+  static unsigned index(std::uint64_t value) {
+      if (value < sub_count) return unsigned(value);
+      unsigned msb = 63 - __builtin_clzll(value);
+      unsigned shift = msb - sub_bits;
+      return (shift + 1) * sub_count + unsigned((value >> shift) - sub_count);
+  }
+  static std::uint64_t lowest(unsigned i) {
+      if (i < sub_count) return i;
+      unsigned shift = i / sub_count - 1;
+      return std::uint64_t(sub_count + i % sub_count) << shift;
+  }
+  std::atomic<std::uint64_t> _counts[bucket_count];
+  std::atomic<std::uint64_t> _max;
+};
+
+class Stage;
+enum Phase { enqueue_phase, start_phase, finish_phase };
+
+struct Event {
+  const Stage* stage;
+  Phase phase;
+  std::uint64_t id;
+  std::uint64_t ns;
+};
+
+/**
+ * Events of one thread, the oldest are overwritten when full.
+ * Single writer, read by the exporter once the pipeline is quiet.
+ */
+class RingBuffer {
+public:
+  static const std::size_t capacity = 1 << 14;
+  explicit RingBuffer(unsigned tid) : _tid(tid), _head(0) {}
+  void push(const Stage* stage, Phase phase, std::uint64_t id, std::uint64_t ns) {
+      std::uint64_t head = _head.load(std::memory_order_relaxed);
+      _events[head % capacity] = Event{stage, phase, id, ns};
+      _head.store(head + 1, std::memory_order_release);
+  }
+  template<class F> void forEach(F f) const {
+      std::uint64_t head = _head.load(std::memory_order_acquire);
+      for (std::uint64_t i = head > capacity ? head - capacity : 0; i < head; ++i) {
+          f(_events[i % capacity]);
+      }
+  }
+  unsigned tid() const { return _tid; }
+
+private:
+  unsigned _tid;
+  std::atomic<std::uint64_t> _head;
+  Event _events[capacity];
+};
+
+/**
+ * Registry of stages and per-thread buffers, both live until exit so the
+ * trace of finished threads can still be exported.
+ */
+struct Registry {
+  std::mutex m;
+  std::vector<const Stage*> stages;
+  std::vector<std::unique_ptr<RingBuffer>> buffers;
+  std::atomic<std::uint64_t> ids{0};
+};
+
+inline Registry& registry() {
+    static Registry* r = new Registry;
+    return *r;
+}
+
+inline RingBuffer& buffer() {
+    thread_local RingBuffer* t_buffer = nullptr;
+    if (!t_buffer) {
+        Registry& r = registry();
+        std::lock_guard<std::mutex> lock(r.m);
+        r.buffers.emplace_back(new RingBuffer(unsigned(r.buffers.size())));
+        t_buffer = r.buffers.back().get();
+    }
+    return *t_buffer;
+}
+
+class Stage {
+public:
+  explicit Stage(const char* name) : _name(name) {
+      Registry& r = registry();
+      std::lock_guard<std::mutex> lock(r.m);
+      r.stages.push_back(this);
+  }
+  const char* name() const { return _name; }
+  Histogram wait;
+  Histogram run;
+
+private:
+  const char* _name;
+};
+
+/** identity of one piece of work, taken when it is enqueued */
+struct Stamp {
+  std::uint64_t id;
+  std::uint64_t enqueued;
+};
+
+inline Stamp enqueue(Stage& stage) {
+    Stamp stamp = {registry().ids.fetch_add(1, std::memory_order_relaxed), now()};
+    buffer().push(&stage, enqueue_phase, stamp.id, stamp.enqueued);
+    return stamp;
+}
+
+/** scope of running one piece of work */
+class Span {
+public:
+  Span(Stage& stage, const Stamp& stamp) : _stage(stage), _id(stamp.id), _start(now()) {
+      _stage.wait.record(_start - stamp.enqueued);
+      buffer().push(&_stage, start_phase, _id, _start);
+  }
+  /** work not going through a queue */
+  explicit Span(Stage& stage) : Span(stage, enqueue(stage)) {}
+  ~Span() {
+      std::uint64_t finish = now();
+      _stage.run.record(finish - _start);
+      buffer().push(&_stage, finish_phase, _id, finish);
+  }
+  Span(const Span&) = delete;
+  Span& operator=(const Span&) = delete;
+
+private:
+  Stage& _stage;
+  std::uint64_t _id;
+  std::uint64_t _start;
+};
+
+inline void writeChromeTrace(std::ostream& out) {
+    Registry& r = registry();
+    std::lock_guard<std::mutex> lock(r.m);
+    const char* phases[] = {"i", "B", "E"};
+    const char* separator = "";
+    out << "{\"traceEvents\":[";
+    for (auto& buffer : r.buffers) {
+        unsigned tid = buffer->tid();
+        buffer->forEach([&](const Event& e) {
+            out << separator << "{\"name\":\"" << e.stage->name()
+                << "\",\"ph\":\"" << phases[e.phase]
+                << "\",\"ts\":" << double(e.ns) / 1000.0
+                << ",\"pid\":1,\"tid\":" << tid
+                << (e.phase == enqueue_phase ? ",\"s\":\"t\"" : "")
+                << ",\"args\":{\"id\":" << e.id << "}}";
+            separator = ",\n";
+        });
+    }
+    out << "]}\n";
+}
+
+inline void printHistograms(std::ostream& out) {
+    Registry& r = registry();
+    std::lock_guard<std::mutex> lock(r.m);
+    for (const Stage* stage : r.stages) {
+        const Histogram* histograms[] = {&stage->wait, &stage->run};
+        const char* names[] = {"wait", "run"};
+        for (int i = 0; i < 2; ++i) {
+            const Histogram& h = *histograms[i];
+            out << stage->name() << " " << names[i] << ": n=" << h.count()
+                << " p50=" << h.percentile(50) << "ns"
+                << " p99=" << h.percentile(99) << "ns"
+                << " p99.9=" << h.percentile(99.9) << "ns"
+                << " max=" << h.max() << "ns\n";
+        }
+    }
+}
+
+#else
+
+struct Stage {
+  explicit Stage(const char*) {}
+};
+struct Stamp {};
+inline Stamp enqueue(Stage&) { return Stamp(); }
+struct Span {
+  Span(Stage&, const Stamp&) {}
+  explicit Span(Stage&) {}
+};
+inline void writeChromeTrace(std::ostream&) {}
+inline void printHistograms(std::ostream&) {}
+
+#endif
+
+/** the stages of this pipeline */
+inline Stage asyncApi("asyncApi");
+inline Stage bind("Bind");
+inline Stage loop("Loop");
+inline Stage loopN("LoopN");
+inline Stage coLoopN("coLoopN");
+
+} // namespace trace
+
+/**
+ * Executor
+ * Something that runs tasks, somewhere, sometime later.
+ * Decouples the continuations from the way their work gets scheduled.
+ */
+struct Executor {
+  virtual ~Executor() {}
+  virtual void execute(std::function<void()> task) = 0;
+};
+
+/**
+ * Executor starting a new detached thread per task
+ * (the behaviour asyncApi used to hardcode)
+ */
+struct NewThreadExecutor : Executor {
+  virtual ~NewThreadExecutor() {}
+  void execute(std::function<void()> task) {
+      std::thread(task).detach();
+  }
+};
+
+/**
+ * Fixed-size work-stealing thread pool
+ * Every worker owns a deque. Tasks posted from a worker go to its own deque,
+ * others are distributed round-robin. A worker pops from the back of its own
+ * deque (most recent, cache-warm work) and steals from the front of the others
+ * when it runs dry. Threads are created once in the constructor.
+ */
+class ThreadPool : public Executor {
+public:
+  explicit ThreadPool(unsigned n = std::max(2u, std::thread::hardware_concurrency()))
+      : _pending(0), _next(0), _stop(false) {
+      for (unsigned i = 0; i < n; ++i) {
+          _queues.emplace_back(new Queue);
+      }
+      for (unsigned i = 0; i < n; ++i) {
+          _threads.emplace_back([this, i]() { run(i); });
+      }
+  }
+  virtual ~ThreadPool() {
+      {
+          std::lock_guard<std::mutex> lock(_m);
+          _stop = true;
+      }
+      _cv.notify_all();
+      for (auto& th : _threads) {
+          th.join();
+      }
+  }
+  void execute(std::function<void()> task) {
+      unsigned i = (t_pool == this) ? t_index
+                 : _next.fetch_add(1, std::memory_order_relaxed) % _queues.size();
+      {
+          // counted together with the push, a worker can't take the task
+          // before it is counted and wrap the counter
+          std::lock_guard<std::mutex> lock(_queues[i]->m);
+          _queues[i]->tasks.push_back(std::move(task));
+          ++_pending;
+      }
+      {
+          // a worker between its check of _pending and its wait holds _m
+          std::lock_guard<std::mutex> lock(_m);
+      }
+      _cv.notify_one();
+  }
+  std::size_t size() const { return _threads.size(); }
+  /** whether the caller is one of the workers */
+  bool runsOnThisThread() const { return t_pool == this; }
+
+private:
+  struct Queue {
+      std::mutex m;
+      std::deque<std::function<void()>> tasks;
+  };
+
+  bool pop(unsigned i, std::function<void()>& task) {
+      std::lock_guard<std::mutex> lock(_queues[i]->m);
+      if (_queues[i]->tasks.empty()) return false;
+      task = std::move(_queues[i]->tasks.back());
+      _queues[i]->tasks.pop_back();
+      --_pending;
+      return true;
+  }
+  bool steal(unsigned i, std::function<void()>& task) {
+      for (std::size_t k = 1; k < _queues.size(); ++k) {
+          Queue& victim = *_queues[(i + k) % _queues.size()];
+          std::lock_guard<std::mutex> lock(victim.m);
+          if (!victim.tasks.empty()) {
+              task = std::move(victim.tasks.front());
+              victim.tasks.pop_front();
+              --_pending;
+              return true;
+          }
+      }
+      return false;
+  }
+  void run(unsigned i) {
+      t_pool = this;
+      t_index = i;
+      for (;;) {
+          std::function<void()> task;
+          if (pop(i, task) || steal(i, task)) {
+              task();
+              continue;
+          }
+          std::unique_lock<std::mutex> lock(_m);
+          _cv.wait(lock, [this]() { return _pending > 0 || _stop; });
+          if (_stop) return;
+      }
+  }
+
+  std::vector<std::unique_ptr<Queue>> _queues;
+  std::vector<std::thread> _threads;
+  std::mutex _m;
+  std::condition_variable _cv;
+  std::atomic<unsigned> _pending;
+  std::atomic<unsigned> _next;
+  bool _stop;
+
+  static thread_local ThreadPool* t_pool;
+  static thread_local unsigned t_index;
+};
+thread_local ThreadPool* ThreadPool::t_pool = nullptr;
+thread_local unsigned ThreadPool::t_index = 0;
+
+/**
+ * Process wide pool used whenever no executor is given explicitly
+ */
+inline Executor& defaultExecutor() {
+    static ThreadPool pool;
+    return pool;
+}
+
+/**
+ * Trampoline
+ * Runs a task inline on the calling thread. A task posted while another one
+ * is already running on this thread is queued and run once that one has
+ * returned, instead of nesting on the stack. Synchronous completions in a
+ * chain become an iterative loop with constant stack use, asynchronous ones
+ * arrive on a thread without running trampoline and run straight away.
+ */
+class Trampoline : public Executor {
+public:
+  virtual ~Trampoline() {}
+  void execute(std::function<void()> task) {
+      if (t_running) {
+          t_queue.push_back(std::move(task));
+          return;
+      }
+      t_running = true;
+      task();
+      while (!t_queue.empty()) {
+          std::function<void()> next = std::move(t_queue.front());
+          t_queue.pop_front();
+          next();
+      }
+      t_running = false;
+  }
+
+private:
+  static thread_local bool t_running;
+  static thread_local std::deque<std::function<void()>> t_queue;
+};
+thread_local bool Trampoline::t_running = false;
+thread_local std::deque<std::function<void()>> Trampoline::t_queue;
+
+inline Executor& trampoline() {
+    static Trampoline t;
+    return t;
+}
+
+/**
+ * Timer thread, runs each task on its executor once its deadline passed.
+ * Stands in for the device or network completing a request.
+ */
+class Timer {
+public:
+  typedef std::chrono::steady_clock Clock;
+  Timer() : _stop(false), _thread([this]() { run(); }) {}
+  ~Timer() {
+      {
+          std::lock_guard<std::mutex> lock(_m);
+          _stop = true;
+      }
+      _cv.notify_one();
+      _thread.join();
+  }
+  void at(Clock::time_point deadline, Executor& executor, std::function<void()> task) {
+      {
+          std::lock_guard<std::mutex> lock(_m);
+          _entries.push(Entry{deadline, &executor, std::move(task)});
+      }
+      _cv.notify_one();
+  }
+
+private:
+  struct Entry {
+      Clock::time_point deadline;
+      Executor* executor;
+      std::function<void()> task;
+      bool operator<(const Entry& other) const { return deadline > other.deadline; }
+  };
+  void run() {
+      std::unique_lock<std::mutex> lock(_m);
+      while (!_stop) {
+          if (_entries.empty()) {
+              _cv.wait(lock);
+          } else if (Clock::now() < _entries.top().deadline) {
+              // a copy: at() may reallocate the queue while we wait unlocked
+              Clock::time_point deadline = _entries.top().deadline;
+              _cv.wait_until(lock, deadline);
+          } else {
+              Entry entry = _entries.top();
+              _entries.pop();
+              // unlocked: an inline executor runs the task right here, and
+              // the task may well schedule the next timer
+              lock.unlock();
+              entry.executor->execute(std::move(entry.task));
+              lock.lock();
+          }
+      }
+  }
+  std::mutex _m;
+  std::condition_variable _cv;
+  std::priority_queue<Entry> _entries;
+  bool _stop;
+  std::thread _thread;
+};
+
+inline Timer& timer() {
+    static Timer t;
+    return t;
+}
+
+/**
+ * Batching executor
+ * Collects tasks into a run-queue and hands them to the target executor in
+ * bursts: a burst is posted once batchSize tasks are queued, or maxLatency
+ * after the first task entered an empty queue, whichever comes first. At
+ * most one burst is posted at a time, tasks queued meanwhile join it. One
+ * wakeup then runs the whole burst back to back on a single worker.
+ * Meant for short handlers, a blocking task stalls the rest of its burst.
+ * The target has to outlive the executor, the destructor posts what is
+ * still queued.
+ */
+class BatchingExecutor : public Executor {
+public:
+  explicit BatchingExecutor(Executor& target = defaultExecutor(),
+                            std::size_t batchSize = 64,
+                            std::chrono::microseconds maxLatency = std::chrono::microseconds(100))
+      : _state(std::make_shared<State>(target, batchSize, maxLatency)) {}
+  virtual ~BatchingExecutor() {
+      bool pending;
+      {
+          std::unique_lock<std::mutex> lock(_state->m);
+          // a timer still posting a burst would reach target after us
+          _state->closed = true;
+          _state->idle.wait(lock, [this]() { return _state->posting == 0; });
+          pending = !_state->queue.empty() && !_state->drainPosted;
+      }
+      if (pending) {
+          post(_state);
+      }
+  }
+  void execute(std::function<void()> task) {
+      bool first, full;
+      {
+          std::lock_guard<std::mutex> lock(_state->m);
+          _state->queue.push_back(std::move(task));
+          first = _state->queue.size() == 1 && !_state->drainPosted;
+          full = _state->queue.size() >= _state->batchSize && !_state->drainPosted;
+          if (full) {
+              _state->drainPosted = true;
+          }
+      }
+      if (full) {
+          post(_state);
+      } else if (first) {
+          // the timer only holds the state, it may fire after we are gone.
+          // expire runs inline on the timer thread, outside the timer's lock,
+          // so a target scheduling timers of its own (another
+          // BatchingExecutor, a DelayedApi chain) doesn't deadlock
+          std::shared_ptr<State> state = _state;
+          timer().at(Timer::Clock::now() + state->maxLatency, trampoline(),
+                     [state]() { expire(state); });
+      }
+  }
+  /** posts whatever is queued right now, unless a burst is already posted */
+  void flush() {
+      {
+          std::lock_guard<std::mutex> lock(_state->m);
+          if (_state->queue.empty() || _state->drainPosted) {
+              return;
+          }
+          _state->drainPosted = true;
+      }
+      post(_state);
+  }
+
+private:
+  struct State {
+      State(Executor& target, std::size_t batchSize, std::chrono::microseconds maxLatency)
+          : target(target), batchSize(std::max<std::size_t>(1, batchSize)),
+            maxLatency(maxLatency), drainPosted(false), closed(false), posting(0) {}
+      Executor& target;
+      const std::size_t batchSize;
+      const std::chrono::microseconds maxLatency;
+      std::mutex m;
+      std::condition_variable idle;
+      std::vector<std::function<void()>> queue;
+      bool drainPosted;  // a drain is on its way to target
+      bool closed;       // the executor is gone, target may be too
+      int posting;       // timers between their check and target.execute
+  };
+  static void post(const std::shared_ptr<State>& state) {
+      std::shared_ptr<State> captured = state;
+      state->target.execute([captured]() { drain(*captured); });
+  }
+  /** maxLatency passed since the burst started */
+  static void expire(const std::shared_ptr<State>& state) {
+      {
+          std::lock_guard<std::mutex> lock(state->m);
+          if (state->closed || state->drainPosted || state->queue.empty()) {
+              return;
+          }
+          state->drainPosted = true;
+          ++state->posting;
+      }
+      post(state);
+      {
+          std::lock_guard<std::mutex> lock(state->m);
+          --state->posting;
+      }
+      state->idle.notify_all();
+  }
+  static void drain(State& state) {
+      std::vector<std::function<void()>> batch;
+      {
+          std::lock_guard<std::mutex> lock(state.m);
+          batch.swap(state.queue);
+          state.drainPosted = false;
+      }
+      for (auto& task : batch) {
+          task();
+      }
+  }
+  std::shared_ptr<State> _state;
+};
+
+/**
+ * Cancellation token
+ * Copies share one state, so everyone working on a chain sees cancel().
+ * A token can also carry a deadline after which it counts as cancelled.
+ * The default constructed token can never be cancelled and costs nothing.
+ */
+class CancellationToken {
+public:
+  typedef std::chrono::steady_clock Clock;
+  CancellationToken() {}
+  static CancellationToken cancellable() {
+      return until(Clock::time_point::max());
+  }
+  static CancellationToken until(Clock::time_point deadline) {
+      CancellationToken token;
+      token._state = std::make_shared<State>(deadline);
+      return token;
+  }
+  template<class Duration>
+  static CancellationToken after(Duration timeout) {
+      return until(Clock::now() + timeout);
+  }
+  void cancel() const {
+      if (!_state) return;
+      {
+          std::lock_guard<std::mutex> lock(_state->m);
+          _state->cancelled = true;
+      }
+      _state->cv.notify_all();
+  }
+  bool cancelled() const {
+      return _state && (_state->cancelled || Clock::now() >= _state->deadline);
+  }
+  /**
+   * Sleeps for timeout, or less if cancelled in the meantime.
+   * Returns whether the token got cancelled.
+   */
+  template<class Duration>
+  bool waitFor(Duration timeout) const {
+      if (!_state) {
+          std::this_thread::sleep_for(timeout);
+          return false;
+      }
+      Clock::time_point wakeup = std::min(_state->deadline, Clock::now() + timeout);
+      std::unique_lock<std::mutex> lock(_state->m);
+      _state->cv.wait_until(lock, wakeup, [this]() { return bool(_state->cancelled); });
+      return cancelled();
+  }
+
+private:
+  struct State {
+      explicit State(Clock::time_point deadline) : cancelled(false), deadline(deadline) {}
+      std::mutex m;
+      std::condition_variable cv;
+      std::atomic<bool> cancelled;
+      const Clock::time_point deadline;
+  };
+  std::shared_ptr<State> _state;
+};
 
 /**
  * Fake async API, simulates an asynchronous process.
- * Starts a thread sleeping for 3secs then simulates an event calling handler
+ * Posts a task to the executor sleeping for 3secs then simulates an event
+ * calling handler. Note the sleep occupies a worker for its whole duration.
+ * Cancelling the token cuts the sleep short and drops the handler unused.
  */
-void asyncApi(std::function<void(std::string)> handler) {
-    std::cout << "called async in thread: " << std::this_thread::get_id() << "\n";
-    std::thread th([handler]() {
-        std::cout << "Started async, sleeping 3secs\n";
-        std::this_thread::sleep_for(std::chrono::seconds(3));
+void asyncApi(std::function<void(std::string)> handler,
+              Executor& executor = defaultExecutor(),
+              const CancellationToken& token = CancellationToken()) {
+    trace::Stamp stamp = trace::enqueue(trace::asyncApi);
+    executor.execute([handler, token, stamp]() {
+        trace::Span span(trace::asyncApi, stamp);
+        if (token.waitFor(std::chrono::seconds(3))) {
+            return;
+        }
         handler("Data from async");
     });
-    th.detach();
 }
 
 /**
@@ -45,46 +741,85 @@ struct Continuator {
  * Well, whatever it is, we can do it inside the continuation.
  */
 struct AsyncApi : Continuator<void, std::string> {
+  explicit AsyncApi(Executor& executor = defaultExecutor(),
+                    const CancellationToken& token = CancellationToken())
+      : _executor(&executor), _token(token) {}
   virtual ~AsyncApi() {}
   void andThen(std::function<void(std::string)> k) {
-      asyncApi(k);
+      asyncApi(k, *_executor, _token);
   }
+  Executor* _executor;
+  CancellationToken _token;
 };
 
 
 /**
  * "continuation monad" Monadic bind
+ * The rest of the computation is posted to the executor. By default that is
+ * the trampoline: it still runs on the thread completing _ktor, but a
+ * synchronously completing _ktor no longer adds a stack frame per step.
+ * A result other than void can't be carried through an executor, for those
+ * the default is nullptr: rest runs inline and its result is returned.
+ * Once the token is cancelled neither _ktor nor rest get started any more and
+ * the chain ends, returning R().
  */
 template<class R, class A, class C>
 struct Bind : Continuator<R, A> {
-  Bind(const C& ktor, std::function<std::unique_ptr<Continuator<R, A>>(A)> rest)
-      : _ktor(ktor), _rest(rest){
+  Bind(const C& ktor, std::function<std::unique_ptr<Continuator<R, A>>(A)> rest,
+       Executor* executor = std::is_void<R>::value ? &trampoline() : nullptr,
+       const CancellationToken& token = CancellationToken())
+      : _ktor(ktor), _rest(rest), _executor(executor), _token(token) {
   }
   virtual ~Bind() {}
   R andThen(std::function<R(A)> k) {
+      if (_token.cancelled()) {
+          return R();
+      }
       std::function<std::unique_ptr<Continuator<R, A>>(A)> rest = _rest;
-      std::function<R(A)> lambda = [k, rest](A a) {
+      Executor* executor = _executor;
+      CancellationToken token = _token;
+      std::function<R(A)> lambda = [k, rest, executor, token](A a) {
+          if (token.cancelled()) {
+              return R();
+          }
+          if (executor) {
+              trace::Stamp stamp = trace::enqueue(trace::bind);
+              executor->execute([k, rest, a, stamp]() {
+                  trace::Span span(trace::bind, stamp);
+                  rest(a)->andThen(k);
+              });
+              return R();
+          }
+          trace::Span span(trace::bind);
           return rest(a)->andThen(k);
       };
-      _ktor.andThen(lambda);
+      return _ktor.andThen(lambda);
   }
   C _ktor;
   std::function<std::unique_ptr<Continuator<R, A>>(A)> _rest;
+  Executor* _executor;
+  CancellationToken _token;
 };
 
 /**
  * Continuation containing of multiple sub-continuations
  */
 struct Loop : Continuator<void, std::string> {
-    Loop(std::string s) : _s(s) {}
+    Loop(std::string s, Executor& executor = defaultExecutor(),
+         const CancellationToken& token = CancellationToken())
+        : _s(s), _executor(&executor), _token(token) {}
     virtual ~Loop() {}
     void andThen(std::function<void(std::string)> k) {
-        std::cout << "Loop::andThen: " <<_s << std::endl;
-        Bind<void, std::string, AsyncApi>(AsyncApi(), [](std::string k) {
-          return std::unique_ptr<Continuator>(new Loop(k));
-        }).andThen(k);
+        trace::Span span(trace::loop);
+        Executor* executor = _executor;
+        CancellationToken token = _token;
+        Bind<void, std::string, AsyncApi>(AsyncApi(*executor, token), [executor, token](std::string k) {
+          return std::unique_ptr<Continuator>(new Loop(k, *executor, token));
+        }, &trampoline(), token).andThen(k);
     }
     std::string _s;
+    Executor* _executor;
+    CancellationToken _token;
 };
 
 /**
@@ -100,25 +835,255 @@ struct Return : Continuator<R, A> {
 };
 
 struct LoopN : Continuator<void, std::string> {
-    LoopN(std::string s, int n) : _s(s), _n(n) {}
+    LoopN(std::string s, int n, Executor& executor = defaultExecutor(),
+          const CancellationToken& token = CancellationToken())
+        : _s(s), _n(n), _executor(&executor), _token(token) {}
     void andThen(std::function<void(std::string)> k) {
-        std::cout << "[LoopN::andThen] " <<_s << " " << _n << std::endl;
+        trace::Span span(trace::loopN);
         int n = _n;
-        Bind<void, std::string, AsyncApi>(AsyncApi(),
-        [n](std::string s) -> std::unique_ptr<Continuator<void, std::string>> {
+        Executor* executor = _executor;
+        CancellationToken token = _token;
+        Bind<void, std::string, AsyncApi>(AsyncApi(*executor, token),
+        [n, executor, token](std::string s) -> std::unique_ptr<Continuator<void, std::string>> {
             if (n > 0) {
                 return std::unique_ptr<Continuator<void, std::string>>(
-                    new LoopN(s, n - 1));
+                    new LoopN(s, n - 1, *executor, token));
             } else {
                 return std::unique_ptr<Continuator<void, std::string>> (
                     new Return<void, std::string>("Done!"));
             }
-        }).andThen(k);
+        }, &trampoline(), token).andThen(k);
     }
     std::string _s;
     int    _n;
+    Executor* _executor;
+    CancellationToken _token;
+};
+
+/**
+ * Fan-out/fan-in
+ * WhenAll starts all its continuators at once and, when the last of them has
+ * completed, hands their results in input order to the continuation.
+ * Completion is counted on an atomic, no lock is taken: every branch writes
+ * its own slot and the branch decrementing to zero delivers the vector.
+ * A has to be default constructible.
+ */
+template<class A>
+struct WhenAll : Continuator<void, std::vector<A>> {
+  typedef std::vector<std::shared_ptr<Continuator<void, A>>> Continuators;
+  explicit WhenAll(const Continuators& ktors) : _ktors(ktors) {}
+  virtual ~WhenAll() {}
+  void andThen(std::function<void(std::vector<A>)> k) {
+      if (_ktors.empty()) {
+          k(std::vector<A>());
+          return;
+      }
+      struct State {
+          State(std::size_t n, std::function<void(std::vector<A>)> k)
+              : results(n), remaining(n), k(k) {}
+          std::vector<A> results;
+          std::atomic<std::size_t> remaining;
+          std::function<void(std::vector<A>)> k;
+      };
+      std::shared_ptr<State> state = std::make_shared<State>(_ktors.size(), k);
+      for (std::size_t i = 0; i < _ktors.size(); ++i) {
+          _ktors[i]->andThen([state, i](A a) {
+              state->results[i] = std::move(a);
+              if (state->remaining.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+                  state->k(std::move(state->results));
+              }
+          });
+      }
+  }
+  Continuators _ktors;
+};
+
+/**
+ * WhenAny starts all its continuators at once and continues with the first
+ * result, later ones are dropped. The winner is picked by an atomic exchange.
+ */
+template<class A>
+struct WhenAny : Continuator<void, A> {
+  typedef std::vector<std::shared_ptr<Continuator<void, A>>> Continuators;
+  explicit WhenAny(const Continuators& ktors) : _ktors(ktors) {}
+  virtual ~WhenAny() {}
+  void andThen(std::function<void(A)> k) {
+      std::shared_ptr<std::atomic<bool>> done = std::make_shared<std::atomic<bool>>(false);
+      for (std::size_t i = 0; i < _ktors.size(); ++i) {
+          _ktors[i]->andThen([done, k](A a) {
+              if (!done->exchange(true, std::memory_order_acq_rel)) {
+                  k(std::move(a));
+              }
+          });
+      }
+  }
+  Continuators _ktors;
+};
+
+template<class A>
+WhenAll<A> whenAll(const std::vector<std::shared_ptr<Continuator<void, A>>>& ktors) {
+    return WhenAll<A>(ktors);
+}
+
+template<class A>
+WhenAny<A> whenAny(const std::vector<std::shared_ptr<Continuator<void, A>>>& ktors) {
+    return WhenAny<A>(ktors);
+}
+
+/**
+ * Statically composed continuators
+ * Same andThen chain semantics as above, but andThen is a template on the
+ * continuation and binds compose by value: no std::function, no unique_ptr,
+ * no virtual call. Every step is a concrete type the compiler can inline,
+ * so a chain costs zero heap allocations per step.
+ */
+template<class A>
+struct StaticReturn {
+  explicit StaticReturn(A x) : _x(x) {}
+  template<class K> auto andThen(K k) {
+      return k(_x);
+  }
+  A _x;
+};
+
+/**
+ * Monadic bind by value, rest has to return one concrete continuator type
+ */
+template<class C, class F>
+struct StaticBind {
+  StaticBind(const C& ktor, const F& rest) : _ktor(ktor), _rest(rest) {}
+  template<class K> auto andThen(K k) {
+      F rest = _rest;
+      return _ktor.andThen([k, rest](auto a) {
+          return rest(a).andThen(k);
+      });
+  }
+  C _ktor;
+  F _rest;
+};
+
+template<class C, class F>
+StaticBind<C, F> staticBind(const C& ktor, const F& rest) {
+    return StaticBind<C, F>(ktor, rest);
+}
+
+/**
+ * LoopN over any source continuator C without type erasure
+ * A negative count plays the role of Return("Done!") so that rest always
+ * yields the same type.
+ */
+template<class C>
+struct StaticLoopN {
+    StaticLoopN(const C& ktor, std::string s, int n) : _ktor(ktor), _s(s), _n(n) {}
+    template<class K> void andThen(K k) {
+        if (_n < 0) {
+            StaticReturn<std::string>("Done!").andThen(k);
+            return;
+        }
+        C ktor = _ktor;
+        int n = _n;
+        staticBind(_ktor, [ktor, n](std::string s) {
+            return StaticLoopN(ktor, s, n - 1);
+        }).andThen(k);
+    }
+    C _ktor;
+    std::string _s;
+    int _n;
 };
 
+/**
+ * Coroutine front-end
+ * Any Continuator<void, A> can be co_awaited from inside a Task, the value
+ * handed to the continuation becomes the result of the co_await expression.
+ * The coroutine frame is the single allocation per task, the LoopN pattern
+ * becomes a plain loop and the stack does not grow from hop to hop.
+ *
+ * Without executor the coroutine resumes on the thread completing the
+ * continuator. A continuator completing synchronously (e.g. Return) does not
+ * suspend at all: whoever of await_suspend and the callback comes second
+ * resumes, so no frame nests on the stack.
+ */
+template<class A>
+struct ContinuatorAwaiter {
+  ContinuatorAwaiter(Continuator<void, A>& ktor, Executor* executor)
+      : _ktor(ktor), _executor(executor), _ready(false) {}
+  bool await_ready() const { return false; }
+  bool await_suspend(std::coroutine_handle<> handle) {
+      _handle = handle;
+      if (_executor) {
+          _ktor.andThen([this](A a) {
+              _result.emplace(std::move(a));
+              std::coroutine_handle<> h = _handle;
+              _executor->execute([h]() { h.resume(); });
+          });
+          return true;
+      }
+      _ktor.andThen([this](A a) {
+          _result.emplace(std::move(a));
+          if (_ready.exchange(true)) {
+              _handle.resume();
+          }
+      });
+      return !_ready.exchange(true);
+  }
+  A await_resume() {
+      return std::move(*_result);
+  }
+  Continuator<void, A>& _ktor;
+  Executor* _executor;
+  std::coroutine_handle<> _handle;
+  std::optional<A> _result;
+  std::atomic<bool> _ready;
+};
+
+template<class A>
+ContinuatorAwaiter<A> operator co_await(Continuator<void, A>& ktor) {
+    return ContinuatorAwaiter<A>(ktor, nullptr);
+}
+
+template<class A>
+ContinuatorAwaiter<A> operator co_await(Continuator<void, A>&& ktor) {
+    return ContinuatorAwaiter<A>(ktor, nullptr);
+}
+
+/**
+ * co_await via(AsyncApi(), pool) resumes the coroutine on the given executor
+ */
+template<class A>
+ContinuatorAwaiter<A> via(Continuator<void, A>&& ktor, Executor& executor) {
+    return ContinuatorAwaiter<A>(ktor, &executor);
+}
+
+template<class A>
+ContinuatorAwaiter<A> via(Continuator<void, A>& ktor, Executor& executor) {
+    return ContinuatorAwaiter<A>(ktor, &executor);
+}
+
+/**
+ * Fire and forget coroutine, starts eagerly and frees its frame when done
+ */
+struct Task {
+  struct promise_type {
+      Task get_return_object() { return Task(); }
+      std::suspend_never initial_suspend() noexcept { return {}; }
+      std::suspend_never final_suspend() noexcept { return {}; }
+      void return_void() {}
+      void unhandled_exception() { std::terminate(); }
+  };
+};
+
+/**
+ * LoopN written as a plain loop
+ */
+Task coLoopN(std::string s, int n, std::function<void(std::string)> k) {
+    for (; n >= 0; --n) {
+        trace::Stamp stamp = trace::enqueue(trace::coLoopN);
+        s = co_await AsyncApi();
+        trace::Span span(trace::coLoopN, stamp);
+    }
+    k("Done!");
+}
+
 // Alternative without Lambdas ...
 struct myAsyncHandler {
   void operator()(std::string s) {
@@ -128,7 +1093,167 @@ struct myAsyncHandler {
   }
 };
 
-int main() {
+/**
+ * Synchronous source, completes immediately on the calling thread.
+ * Usable by both the virtual and the static chains, lets the benchmark
+ * measure the cost of the chain machinery alone.
+ */
+struct ImmediateApi : Continuator<void, std::string> {
+  virtual ~ImmediateApi() {}
+  void andThen(std::function<void(std::string)> k) {
+      k("Data");
+  }
+  template<class K> void andThen(K k) {
+      k("Data");
+  }
+};
+
+/**
+ * Async source with a fixed latency which, unlike AsyncApi, doesn't block a
+ * worker while waiting: the completion is posted to the executor by the timer.
+ */
+struct DelayedApi : Continuator<void, std::string> {
+  explicit DelayedApi(std::chrono::microseconds latency,
+                      Executor& executor = defaultExecutor())
+      : _latency(latency), _executor(&executor) {}
+  virtual ~DelayedApi() {}
+  void andThen(std::function<void(std::string)> k) {
+      timer().at(Timer::Clock::now() + _latency, *_executor, [k]() { k("Data"); });
+  }
+  std::chrono::microseconds _latency;
+  Executor* _executor;
+};
+
+/**
+ * LoopN built from the virtual Bind over any source C, the reference chain
+ */
+template<class C>
+struct SourceLoopN : Continuator<void, std::string> {
+    SourceLoopN(const C& ktor, int n) : _ktor(ktor), _n(n) {}
+    void andThen(std::function<void(std::string)> k) {
+        C ktor = _ktor;
+        int n = _n;
+        Bind<void, std::string, C>(_ktor,
+        [ktor, n](std::string) -> std::unique_ptr<Continuator<void, std::string>> {
+            if (n > 0) {
+                return std::unique_ptr<Continuator<void, std::string>>(
+                    new SourceLoopN(ktor, n - 1));
+            } else {
+                return std::unique_ptr<Continuator<void, std::string>> (
+                    new Return<void, std::string>("Done!"));
+            }
+        }).andThen(k);
+    }
+    C _ktor;
+    int _n;
+};
+
+/**
+ * Runs chain(steps, k) a few times, prints ns and allocations per step
+ */
+template<class Chain>
+void benchmarkChain(const char* name, Chain chain, int steps = 1000, int runs = 200) {
+    std::size_t done = 0;
+    auto counting = [&done](std::string) { ++done; };
+    bench::result r = bench::run("continuations", name, double(steps + 1) * runs, [&]() {
+        for (int run = 0; run < runs; ++run) {
+            chain(steps, counting);
+        }
+    });
+    std::cout << name << ": " << r.ns_per_op() << " ns/step, "
+              << r.allocs_per_op() << " allocs/step"
+              << " (" << done << " completions)" << std::endl;
+}
+
+/**
+ * Throughput of many tiny completions landing at once on a pool, posted one
+ * by one versus through a BatchingExecutor in front of the same pool
+ */
+void benchmarkBatching() {
+    const int n = 200000;
+    auto run = [n](const char* name, Executor& executor) {
+        std::atomic<int> done(0);
+        std::promise<void> finished;
+        bench::result r = bench::run("continuations", name, n, [&]() {
+            for (int i = 0; i < n; ++i) {
+                executor.execute([&done, &finished, n]() {
+                    if (done.fetch_add(1, std::memory_order_relaxed) + 1 == n) {
+                        finished.set_value();
+                    }
+                });
+            }
+            finished.get_future().wait();
+        });
+        std::cout << name << ": " << r.ns_per_op() << " ns/completion, "
+                  << r.allocs_per_op() << " allocs/completion" << std::endl;
+    };
+    ThreadPool pool;
+    run("pool, one task per completion", pool);
+    BatchingExecutor batching(pool, 64);
+    run("pool, batches of 64", batching);
+}
+
+/**
+ * Latency of n calls to a 100us DelayedApi, sequenced through Bind versus
+ * fanned out through whenAll
+ */
+void benchmarkFanOut() {
+    const std::chrono::microseconds latency(100);
+    for (int n = 1; n <= 1024; n *= 4) {
+        std::string calls = std::to_string(n) + " calls, ";
+        bench::result sequential = bench::run("continuations", calls + "sequential Bind", n, [&]() {
+            std::promise<void> done;
+            SourceLoopN<DelayedApi>(DelayedApi(latency), n - 1).andThen(
+                [&done](std::string) { done.set_value(); });
+            done.get_future().wait();
+        });
+
+        std::vector<std::shared_ptr<Continuator<void, std::string>>> apis;
+        for (int i = 0; i < n; ++i) {
+            apis.push_back(std::make_shared<DelayedApi>(latency));
+        }
+        bench::result parallel = bench::run("continuations", calls + "whenAll", n, [&]() {
+            std::promise<void> done;
+            whenAll(apis).andThen(
+                [&done](std::vector<std::string>) { done.set_value(); });
+            done.get_future().wait();
+        });
+
+        std::cout << n << " calls: sequential Bind " << sequential.ns / 1000
+                  << " us, whenAll " << parallel.ns / 1000 << " us" << std::endl;
+    }
+}
+
+void benchmark() {
+    benchmarkChain("virtual Bind/LoopN", [](int n, std::function<void(std::string)> k) {
+        SourceLoopN<ImmediateApi>(ImmediateApi(), n).andThen(k);
+    });
+    // would overflow the stack without the trampoline in Bind
+    benchmarkChain("virtual Bind/LoopN, 1M steps", [](int n, std::function<void(std::string)> k) {
+        SourceLoopN<ImmediateApi>(ImmediateApi(), n).andThen(k);
+    }, 1000000, 1);
+    benchmarkChain("static  Bind/LoopN", [](int n, auto k) {
+        StaticLoopN<ImmediateApi>(ImmediateApi(), "Loop: ", n).andThen(k);
+    });
+    benchmarkChain("co_await    LoopN", [](int n, auto k) {
+        [](int n, auto k) -> Task {
+            std::string s;
+            for (; n >= 0; --n) {
+                s = co_await ImmediateApi();
+            }
+            k(s);
+        }(n, k);
+    });
+    benchmarkFanOut();
+    benchmarkBatching();
+}
+
+int main(int argc, char* argv[]) {
+  if (argc > 1 && std::string(argv[1]) == "bench") {
+      benchmark();
+      return 0;
+  }
+
   std::cout << "simple call... done in 5 seconds" << std::endl;
   // Here's how you could use AsyncApi
   // with the continuation in the form of a lambda function:
@@ -166,11 +1291,74 @@ int main() {
   //     std::cout << "My Final Hanlder: " << s << std::endl;
   // });
 
+  // every iteration is scheduled on the default pool, no thread is created
+  // per call. Pass an executor to pick another one, e.g.
+  // ThreadPool pool(4); LoopN("Loop: ", 4, pool)...
   LoopN("Loop: ", 4).andThen(myAsyncHandler());
 
+  // the same loop as coroutine, running concurrently
+  coLoopN("coLoop: ", 4, myAsyncHandler());
+
   // run counter in parallel
   for(int i = 0; i < 20; ++i) {
       std::cout << i << std::endl;
       std::this_thread::sleep_for(std::chrono::seconds(1));
   }
+
+  // via(): the coroutine resumes on a worker of the pool, although
+  // ImmediateApi completes right here
+  ThreadPool pool(2);
+  std::promise<bool> resumedOnPool;
+  [](ThreadPool& pool, std::promise<bool>& resumed) -> Task {
+      co_await via(ImmediateApi(), pool);
+      resumed.set_value(pool.runsOnThisThread());
+  }(pool, resumedOnPool);
+  std::cout << "via(pool) resumed on a pool thread: "
+            << resumedOnPool.get_future().get() << std::endl;
+
+  // whenAny: three sources complete, only the first result is delivered
+  std::vector<std::shared_ptr<Continuator<void, std::string>>> sources;
+  for (int i = 0; i < 3; ++i) {
+      sources.push_back(std::make_shared<DelayedApi>(std::chrono::microseconds(100 * (i + 1))));
+  }
+  std::atomic<int> delivered(0);
+  whenAny(sources).andThen([&delivered](std::string) { ++delivered; });
+  std::this_thread::sleep_for(std::chrono::milliseconds(100));
+  std::cout << "whenAny of 3 delivered " << delivered << " result" << std::endl;
+
+  // cancel() wakes a pending asyncApi: the worker it occupies is free again
+  // long before its 3 seconds, and the handler is dropped
+  ThreadPool single(1);
+  CancellationToken token = CancellationToken::cancellable();
+  std::atomic<bool> handled(false);
+  asyncApi([&handled](std::string) { handled = true; }, single, token);
+  auto cancelled = std::chrono::steady_clock::now();
+  token.cancel();
+  std::promise<void> released;
+  single.execute([&released]() { released.set_value(); });
+  released.get_future().wait();
+  std::cout << "cancelled asyncApi released its worker after "
+            << std::chrono::duration_cast<std::chrono::milliseconds>(
+                   std::chrono::steady_clock::now() - cancelled).count()
+            << " ms, handler called: " << handled << std::endl;
+
+  // endless loop again, but with a deadline: abandoned after 5 seconds,
+  // the pending call wakes up right away and nothing is scheduled after it
+  std::cout << "endless loop with 5 seconds deadline" << std::endl;
+  Loop("Loop: ", defaultExecutor(), CancellationToken::after(std::chrono::seconds(5)))
+      .andThen([](std::string s) {
+          std::cout << "Never happens: " << s << std::endl;
+      });
+
+  for(int i = 0; i < 7; ++i) {
+      std::cout << i << std::endl;
+      std::this_thread::sleep_for(std::chrono::seconds(1));
+  }
+
+  if (trace::enabled) {
+      trace::printHistograms(std::cout);
+      std::ofstream out("continuations.trace.json");
+      trace::writeChromeTrace(out);
+      std::cout << "trace written to continuations.trace.json" << std::endl;
+  }
 }
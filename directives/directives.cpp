@@ -13,25 +13,86 @@
 #include <iostream>
 #include <string>
 #include <sstream>
+#include <charconv>
+#include <limits>
+#include <chrono>
+#include <string_view>
+#include <tuple>
+#include <utility>
+#include <type_traits>
+#include <vector>
+#include <algorithm>
+#include <cstddef>
+#include <cassert>
+#include <sys/uio.h>
 
-struct Message {
-  std::string destination;
-  std::string source;
+#include "bench.hpp"
+
+template <class String>
+struct basic_message {
+  String      destination;
+  String      source;
   uint64_t    id;
-  Message() : destination("empty"), source("empty"), id(0ULL) {}
+  basic_message() : destination("empty"), source("empty"), id(0ULL) {}
+};
+
+template <class String>
+struct basic_other_message {
+  String      destination;
+  String      source;
+  String      otherId;
+  basic_other_message() : destination("U"), source("V"), otherId("W") {}
 };
 
-struct OtherMessage {
-  std::string destination;
-  std::string source;
-  std::string otherId;
-  OtherMessage() : destination("U"), source("V"), otherId("W") {}
+// The view messages don't copy their strings, they only refer to them:
+// cheaper to build, but the strings have to outlive the message.
+typedef basic_message<std::string> Message;
+typedef basic_message<std::string_view> MessageView;
+typedef basic_other_message<std::string> OtherMessage;
+typedef basic_other_message<std::string_view> OtherMessageView;
+
+// One field of n messages. Assigning a value assigns it to every message, so
+// directives written for a single Message fill the whole column.
+template <class T>
+class column {
+public:
+  column(std::size_t n, const T& value) : values(n, value) {}
+  template <class Value> column& operator=(const Value& value) {
+    std::fill(values.begin(), values.end(), value);
+    return *this;
+  }
+  T& operator[](std::size_t i) { return values[i]; }
+  const T& operator[](std::size_t i) const { return values[i]; }
+  T* data() { return values.data(); }
+  std::size_t size() const { return values.size(); }
+
+private:
+  std::vector<T> values;
+};
+
+// Structure of arrays layout of n messages: directives with a constant value
+// become one fill per column, ids() is a plain loop over the id column.
+struct MessageBatch {
+  column<std::string> destination;
+  column<std::string> source;
+  column<uint64_t>    id;
+  explicit MessageBatch(std::size_t n) : destination(n, "empty"), source(n, "empty"), id(n, 0ULL) {}
+  std::size_t size() const { return id.size(); }
+};
+
+// Fields a directive writes, so that chains can drop writes a later directive
+// of the same chain overwrites anyway.
+enum directive_field : unsigned {
+    destination_field = 1,
+    source_field = 2,
+    id_field = 4
 };
 
 // In cpp-netlib the directives are simple function objects that take a target
 // object as reference and returns a reference to the same object as a result.
 // In code the directive pattern looks like the following:
 struct destination_directive {
+    static constexpr unsigned writes = destination_field;
     const std::string& value;
     explicit destination_directive(const std::string& dest) : value(dest) {}
     destination_directive(const destination_directive& other) : value(other.value) {}
@@ -43,6 +104,7 @@ struct destination_directive {
 };
 
 struct source_directive {
+    static constexpr unsigned writes = source_field;
     const std::string& value;
     explicit source_directive(const std::string& src) : value(src) {}
     source_directive(const source_directive& other) : value(other.value) {}
@@ -53,64 +115,571 @@ struct source_directive {
     }
 };
 
+// The id is kept by value, cheaper than a reference and it can't dangle.
 struct id_directive {
-    const uint64_t& value;
-    explicit id_directive(const uint64_t& id) : value(id) {}
+    static constexpr unsigned writes = id_field;
+    uint64_t value;
+    explicit id_directive(uint64_t id) : value(id) {}
     id_directive(const id_directive& other) : value(other.value) {}
 
-    template <class Input> Input& operator()(Input& input) const;
+    template <class String> basic_message<String>& operator()(basic_message<String>& input) const;
+    template <class String> basic_other_message<String>& operator()(basic_other_message<String>& input) const;
+    MessageBatch& operator()(MessageBatch& input) const {
+        input.id = value;
+        return input;
+    }
 };
-template<> Message& id_directive::operator()<Message>(Message& input) const {
+template <class String>
+basic_message<String>& id_directive::operator()(basic_message<String>& input) const {
     // do something to Input
     input.id = value;
     return input;
 };
-template<> OtherMessage& id_directive::operator()<OtherMessage>(OtherMessage& input) const {
-    std::ostringstream o;
-    o << value;
-    input.otherId = o.str();
+// No stream and no locale: the digits go to the stack and assign reuses the
+// capacity of otherId, so there is no allocation once it is big enough.
+template <class String>
+basic_other_message<String>& id_directive::operator()(basic_other_message<String>& input) const {
+    static_assert(!std::is_same<String, std::string_view>::value,
+                  "a view has no storage for the formatted id");
+    char digits[std::numeric_limits<uint64_t>::digits10 + 1];
+    std::to_chars_result result = std::to_chars(digits, digits + sizeof(digits), value);
+    input.otherId.assign(digits, result.ptr);
     return input;
 };
 
+// The directives above refer to their argument, so they must not outlive the
+// expression that creates them and always copy the value into the target.
+// The owning directives keep the argument instead, and move it into the
+// target when applied as rvalue, as the last directive of a chain is. The
+// view directives refer to a string_view, which string and view messages
+// can take as it is. Field tells which member the directive writes.
+struct destination_of {
+    static constexpr unsigned field = destination_field;
+    template <class Input> static auto& get(Input& input) { return input.destination; }
+};
+
+struct source_of {
+    static constexpr unsigned field = source_field;
+    template <class Input> static auto& get(Input& input) { return input.source; }
+};
+
+template <class Field>
+struct owning_string_directive {
+    static constexpr unsigned writes = Field::field;
+    std::string value;
+    explicit owning_string_directive(std::string value) : value(std::move(value)) {}
+    template <class Input> Input& operator()(Input& input) const & {
+        Field::get(input) = value;
+        return input;
+    }
+    template <class Input> Input& operator()(Input& input) && {
+        static_assert(!std::is_same<std::decay_t<decltype(Field::get(input))>, std::string_view>::value,
+                      "a view can't keep the string of an owning directive, it dies with the directive");
+        Field::get(input) = std::move(value);
+        return input;
+    }
+};
+
+template <class Field>
+struct string_view_directive {
+    static constexpr unsigned writes = Field::field;
+    std::string_view value;
+    explicit string_view_directive(std::string_view value) : value(value) {}
+    template <class Input> Input& operator()(Input& input) const {
+        Field::get(input) = value;
+        return input;
+    }
+};
+
+// Ids first, first + step, ... for the messages of a batch.
+struct ids_directive {
+    static constexpr unsigned writes = id_field;
+    uint64_t first;
+    uint64_t step;
+    ids_directive(uint64_t first, uint64_t step) : first(first), step(step) {}
+    MessageBatch& operator()(MessageBatch& input) const {
+        uint64_t* id = input.id.data();
+        const std::size_t n = input.size();
+        for (std::size_t i = 0; i < n; ++i) {
+            id[i] = first + i * step;
+        }
+        return input;
+    }
+};
+
 struct to_defaults_directive {
+    static constexpr unsigned writes = destination_field | source_field | id_field;
     explicit to_defaults_directive() {}
     template <class Input> Input& operator()(Input& input) const {
-        input.source = "A";
-        input.destination = "B";
-        input.id = 11;
+        return partial<writes>(input);
+    }
+    // only the fields in live, the others are overwritten later in the chain
+    template <unsigned live, class Input> Input& partial(Input& input) const {
+        if constexpr ((live & source_field) != 0) input.source = "A";
+        if constexpr ((live & destination_field) != 0) input.destination = "B";
+        if constexpr ((live & id_field) != 0) input.id = 11;
         return input;
     }
 };
 
 // To simplify directive creation, usually factory or generator functions are
 // defined to return concrete objects of the directive’s type.
+// Lvalue strings are referred to, temporaries are owned and moved, string
+// literals and string_views are viewed.
 inline const destination_directive destination(const std::string& value) {
     return destination_directive(value);
 }
 
+inline owning_string_directive<destination_of> destination(std::string&& value) {
+    return owning_string_directive<destination_of>(std::move(value));
+}
+
+inline string_view_directive<destination_of> destination(std::string_view value) {
+    return string_view_directive<destination_of>(value);
+}
+
+inline string_view_directive<destination_of> destination(const char* value) {
+    return string_view_directive<destination_of>(value);
+}
+
 inline const source_directive source(const std::string& value) {
     return source_directive(value);
 }
 
-inline const id_directive id(const uint64_t& value) {
+inline owning_string_directive<source_of> source(std::string&& value) {
+    return owning_string_directive<source_of>(std::move(value));
+}
+
+inline string_view_directive<source_of> source(std::string_view value) {
+    return string_view_directive<source_of>(value);
+}
+
+inline string_view_directive<source_of> source(const char* value) {
+    return string_view_directive<source_of>(value);
+}
+
+inline const id_directive id(uint64_t value) {
     return id_directive(value);
 }
 
+inline const ids_directive ids(uint64_t first, uint64_t step = 1) {
+    return ids_directive(first, step);
+}
+
 inline const to_defaults_directive to_defaults() {
     return to_defaults_directive();
 }
 
 
-// The trivial implementation of the directive protocol then boils down to the
-// specialization of the shift-left operator on the target type.
+// Directives without a writes mask are opaque, they are always applied. They
+// may read any field too, so no write before them is dropped.
+template <class Directive, class = void>
+struct directive_writes : std::integral_constant<unsigned, 0> {};
+
 template <class Directive>
-inline Message& operator<<(Message& msg, const Directive& directive) {
-  return directive(msg);
+struct directive_writes<Directive, decltype(void(Directive::writes))>
+    : std::integral_constant<unsigned, Directive::writes> {};
+
+// Applies directive to input given the fields still live at its position of
+// the chain: not at all if everything it writes is overwritten later, only
+// the live fields if it writes several and some of them are overwritten.
+template <unsigned live, class Directive, class Input>
+inline void apply_directive(Directive&& directive, Input& input) {
+    constexpr unsigned writes = directive_writes<std::decay_t<Directive>>::value;
+    if constexpr (writes == 0 || (writes & live) == writes) {
+        std::forward<Directive>(directive)(input);
+    } else if constexpr ((writes & live) != 0) {
+        std::forward<Directive>(directive).template partial<writes & live>(input);
+    }
+}
+
+// fields not written by any of the directives Directives after position i
+template <class... Directives>
+constexpr unsigned live_after(std::size_t i) {
+    constexpr unsigned writes[] = {directive_writes<std::decay_t<Directives>>::value..., 0};
+    unsigned written = 0;
+    for (std::size_t j = i + 1; j < sizeof...(Directives) && writes[j] != 0; ++j) {
+        written |= writes[j];
+    }
+    return ~written;
+}
+
+template <unsigned live, class Input, std::size_t... I, class... Directives>
+inline void apply_chain_at(Input& input, std::index_sequence<I...>, Directives&&... directives) {
+    (apply_directive<live & live_after<Directives...>(I)>(std::forward<Directives>(directives), input), ...);
+}
+
+// Applies the chain directives... to input, of the fields written only those
+// in live, which are not overwritten later.
+template <unsigned live, class Input, class... Directives>
+inline void apply_chain(Input& input, Directives&&... directives) {
+    apply_chain_at<live>(input, std::index_sequence_for<Directives...>(),
+                         std::forward<Directives>(directives)...);
+}
+
+// A directive chain kept as directive of its own, e.g. to apply it to many
+// messages. It writes what its directives write and drops dead writes alike.
+// With one opaque directive the whole list is opaque.
+template <class... Directives>
+struct directive_list {
+    static constexpr unsigned writes = ((directive_writes<Directives>::value != 0) && ... && true)
+        ? (directive_writes<Directives>::value | ... | 0u) : 0u;
+    std::tuple<Directives...> directives;
+    explicit directive_list(Directives... directives) : directives(std::move(directives)...) {}
+    template <class Input> Input& operator()(Input& input) const & {
+        return partial<~0u>(input);
+    }
+    template <class Input> Input& operator()(Input& input) && {
+        return std::move(*this).template partial<~0u>(input);
+    }
+    template <unsigned live, class Input> Input& partial(Input& input) const & {
+        std::apply([&input](const Directives&... directive) {
+            apply_chain<live>(input, directive...);
+        }, directives);
+        return input;
+    }
+    template <unsigned live, class Input> Input& partial(Input& input) && {
+        std::apply([&input](Directives&... directive) {
+            apply_chain<live>(input, std::move(directive)...);
+        }, directives);
+        return input;
+    }
+};
+
+template <class... Directives>
+inline directive_list<std::decay_t<Directives>...> directives(Directives&&... directive) {
+    return directive_list<std::decay_t<Directives>...>(std::forward<Directives>(directive)...);
+}
+
+// Applies list to the n messages at messages.
+template <class Input, class... Directives>
+inline void apply_batch(Input* messages, std::size_t n, const directive_list<Directives...>& list) {
+    for (std::size_t i = 0; i < n; ++i) {
+        list(messages[i]);
+    }
+}
+
+// Applies list followed by per_item(i) to the message i of the n messages at
+// messages, as one chain per message: per_item(i) can override list.
+template <class Input, class... Directives, class PerItem>
+inline void apply_batch(Input* messages, std::size_t n, const directive_list<Directives...>& list,
+                        PerItem per_item) {
+    for (std::size_t i = 0; i < n; ++i) {
+        std::apply([&](const Directives&... directive) {
+            apply_chain<~0u>(messages[i], directive..., per_item(i));
+        }, list.directives);
+    }
+}
+
+// The trivial implementation of the directive protocol boils down to the
+// specialization of the shift-left operator on the target type, applying
+// every directive as it comes. Here the shift-left operator only records the
+// directive instead. The chain msg << d1 << d2 << ... << dN builds a
+// pending_directives<Message, D1, ..., DN> temporary, which applies the
+// whole list in one pass when it is destroyed at the end of the full
+// expression. Knowing all directives at compile time, every field is
+// assigned at most once: a write overwritten later in the chain is dropped.
+// Applying is the last use of the recorded directives, they are applied as
+// rvalues and owning directives move their values into the target.
+template <class Input, class... Directives>
+class pending_directives {
+public:
+    pending_directives(Input& input, std::tuple<Directives...>&& directives)
+        : input(input), directives(std::move(directives)), armed(true) {}
+    pending_directives(pending_directives&& other)
+        : input(other.input), directives(std::move(other.directives)), armed(other.armed) {
+        other.armed = false;
+    }
+    pending_directives& operator=(const pending_directives&) = delete;
+
+    ~pending_directives() {
+        if (armed) {
+            std::apply([this](Directives&... directive) {
+                apply_chain<~0u>(input, std::move(directive)...);
+            }, directives);
+        }
+    }
+
+    template <class Directive>
+    friend pending_directives<Input, Directives..., std::decay_t<Directive>>
+    operator<<(pending_directives&& pending, Directive&& directive) {
+        pending.armed = false;
+        return pending_directives<Input, Directives..., std::decay_t<Directive>>(
+            pending.input,
+            std::tuple_cat(std::move(pending.directives),
+                           std::tuple<std::decay_t<Directive>>(std::forward<Directive>(directive))));
+    }
+
+private:
+    Input& input;
+    std::tuple<Directives...> directives;
+    bool armed;
+};
+
+template <class String, class Directive>
+inline pending_directives<basic_message<String>, std::decay_t<Directive>>
+operator<<(basic_message<String>& msg, Directive&& directive) {
+  return pending_directives<basic_message<String>, std::decay_t<Directive>>(
+      msg, std::tuple<std::decay_t<Directive>>(std::forward<Directive>(directive)));
 }
 
 template <class Directive>
-inline OtherMessage& operator<<(OtherMessage& msg, const Directive& directive) {
-  return directive(msg);
+inline pending_directives<MessageBatch, std::decay_t<Directive>>
+operator<<(MessageBatch& batch, Directive&& directive) {
+  return pending_directives<MessageBatch, std::decay_t<Directive>>(
+      batch, std::tuple<std::decay_t<Directive>>(std::forward<Directive>(directive)));
+}
+
+template <class String, class Directive>
+inline pending_directives<basic_other_message<String>, std::decay_t<Directive>>
+operator<<(basic_other_message<String>& msg, Directive&& directive) {
+  return pending_directives<basic_other_message<String>, std::decay_t<Directive>>(
+      msg, std::tuple<std::decay_t<Directive>>(std::forward<Directive>(directive)));
+}
+
+// Wire format of the messages: the fields in declaration order, strings as
+// 32 bit length followed by the bytes, Message::id as 64 bit, all integers
+// little endian. Encoding writes straight into a caller buffer or only
+// points iovecs at the strings, decoding yields views into the input.
+namespace wire {
+    inline char* put(char* out, uint64_t value, unsigned bytes) {
+        for (unsigned i = 0; i < bytes; ++i) {
+            *out++ = char(value >> (8 * i));
+        }
+        return out;
+    }
+
+    inline uint64_t get(const char* in, unsigned bytes) {
+        uint64_t value = 0;
+        for (unsigned i = 0; i < bytes; ++i) {
+            value |= uint64_t(static_cast<unsigned char>(in[i])) << (8 * i);
+        }
+        return value;
+    }
+
+    // longest string a 32 bit length prefix can tell
+    constexpr std::size_t max_string = 0xffffffffu;
+
+    // the callers check encodable() first, a longer string would be cut
+    inline char* put_string(char* out, std::string_view value) {
+        assert(value.size() <= max_string);
+        out = put(out, value.size(), 4);
+        return std::copy(value.begin(), value.end(), out);
+    }
+
+    // takes a string off the front of input, false if input is too short
+    inline bool get_string(std::string_view& input, std::string_view& value) {
+        if (input.size() < 4 || input.size() - 4 < get(input.data(), 4)) {
+            return false;
+        }
+        value = input.substr(4, get(input.data(), 4));
+        input.remove_prefix(4 + value.size());
+        return true;
+    }
+
+    template <class String>
+    std::size_t size(const basic_message<String>& msg) {
+        return 4 + msg.destination.size() + 4 + msg.source.size() + 8;
+    }
+
+    template <class String>
+    std::size_t size(const basic_other_message<String>& msg) {
+        return 4 + msg.destination.size() + 4 + msg.source.size() + 4 + msg.otherId.size();
+    }
+
+    // whether every string of msg fits its length prefix
+    template <class String>
+    bool encodable(const basic_message<String>& msg) {
+        return msg.destination.size() <= max_string && msg.source.size() <= max_string;
+    }
+
+    template <class String>
+    bool encodable(const basic_other_message<String>& msg) {
+        return msg.destination.size() <= max_string && msg.source.size() <= max_string &&
+               msg.otherId.size() <= max_string;
+    }
+
+    template <class String>
+    char* encode(char* out, const basic_message<String>& msg) {
+        out = put_string(out, msg.destination);
+        out = put_string(out, msg.source);
+        return put(out, msg.id, 8);
+    }
+
+    template <class String>
+    char* encode(char* out, const basic_other_message<String>& msg) {
+        out = put_string(out, msg.destination);
+        out = put_string(out, msg.source);
+        return put_string(out, msg.otherId);
+    }
+}
+
+// Caller owned memory messages are appended to, used bytes of capacity.
+// overflow is set once a message didn't fit, it and the ones after it are
+// not written.
+struct wire_buffer {
+    char*       data;
+    std::size_t capacity;
+    std::size_t used;
+    bool        overflow;
+    wire_buffer(char* data, std::size_t capacity)
+        : data(data), capacity(capacity), used(0), overflow(false) {}
+    std::string_view written() const { return std::string_view(data, used); }
+};
+
+// Scatter-gather form of one message, e.g. for writev: the strings are not
+// copied, iov points at them, only lengths and ids go to prefixes. Valid
+// as long as the message stays unchanged. count is 0 for a message with a
+// string too long for the wire format.
+struct wire_iovecs {
+    iovec         iov[6];
+    int           count;
+    char          prefixes[16];
+};
+
+// Appends the message to buffer, sets buffer.overflow instead if it doesn't
+// fit or has a string too long for the wire format: it runs when the chain
+// is applied, in a destructor, so it can't throw.
+struct write_to_directive {
+    wire_buffer& buffer;
+    explicit write_to_directive(wire_buffer& buffer) : buffer(buffer) {}
+    template <class Input> Input& operator()(Input& input) const {
+        if (buffer.overflow || !wire::encodable(input) ||
+            buffer.capacity - buffer.used < wire::size(input)) {
+            buffer.overflow = true;
+            return input;
+        }
+        buffer.used = wire::encode(buffer.data + buffer.used, input) - buffer.data;
+        return input;
+    }
+};
+
+struct gather_to_directive {
+    wire_iovecs& iovecs;
+    explicit gather_to_directive(wire_iovecs& iovecs) : iovecs(iovecs) {}
+    template <class String> basic_message<String>& operator()(basic_message<String>& input) const {
+        iovecs.count = 0;
+        if (!wire::encodable(input)) {
+            return input;
+        }
+        char* prefix = iovecs.prefixes;
+        prefix = add(add(prefix, input.destination), input.source);
+        add_prefix(prefix, wire::put(prefix, input.id, 8));
+        return input;
+    }
+    template <class String> basic_other_message<String>& operator()(basic_other_message<String>& input) const {
+        iovecs.count = 0;
+        if (!wire::encodable(input)) {
+            return input;
+        }
+        add(add(add(iovecs.prefixes, input.destination), input.source), input.otherId);
+        return input;
+    }
+
+private:
+    char* add(char* prefix, std::string_view value) const {
+        char* end = wire::put(prefix, value.size(), 4);
+        add_prefix(prefix, end);
+        iovecs.iov[iovecs.count].iov_base = const_cast<char*>(value.data());
+        iovecs.iov[iovecs.count].iov_len = value.size();
+        ++iovecs.count;
+        return end;
+    }
+    void add_prefix(char* prefix, char* end) const {
+        iovecs.iov[iovecs.count].iov_base = prefix;
+        iovecs.iov[iovecs.count].iov_len = end - prefix;
+        ++iovecs.count;
+    }
+};
+
+inline write_to_directive write_to(wire_buffer& buffer) {
+    return write_to_directive(buffer);
+}
+
+inline gather_to_directive gather_to(wire_iovecs& iovecs) {
+    return gather_to_directive(iovecs);
+}
+
+// Decodes the message at the front of input into msg, which then points into
+// input. Returns the bytes used, 0 if input is truncated.
+inline std::size_t read_from(std::string_view input, MessageView& msg) {
+    const std::size_t size = input.size();
+    if (!wire::get_string(input, msg.destination) ||
+        !wire::get_string(input, msg.source) || input.size() < 8) {
+        return 0;
+    }
+    msg.id = wire::get(input.data(), 8);
+    return size - input.size() + 8;
+}
+
+inline std::size_t read_from(std::string_view input, OtherMessageView& msg) {
+    const std::size_t size = input.size();
+    if (!wire::get_string(input, msg.destination) ||
+        !wire::get_string(input, msg.source) ||
+        !wire::get_string(input, msg.otherId)) {
+        return 0;
+    }
+    return size - input.size();
+}
+
+// The id formatting as it was, for comparison.
+struct ostringstream_id_directive {
+    static constexpr unsigned writes = id_field;
+    uint64_t value;
+    explicit ostringstream_id_directive(uint64_t id) : value(id) {}
+    template <class Input> Input& operator()(Input& input) const {
+        std::ostringstream o;
+        o << value;
+        input.otherId = o.str();
+        return input;
+    }
+};
+
+// FNV-1a of the formatted id, folded into hash.
+inline uint64_t hash_id(uint64_t hash, const std::string& id) {
+    for (char c : id) {
+        hash = (hash ^ static_cast<unsigned char>(c)) * 1099511628211ULL;
+    }
+    // the terminator keeps "1" "23" apart from "12" "3"
+    return (hash ^ 0xff) * 1099511628211ULL;
+}
+
+// Runs n ids through directive into an OtherMessage, prints ids per second.
+// Returns a hash over every formatted id, and over the ids every digit count
+// starts and ends at, 0 and UINT64_MAX included, which the loop misses.
+template <class Directive>
+uint64_t benchmark_id(const char* name, uint64_t n) {
+    OtherMessage msg;
+    std::size_t digits = 0;
+    uint64_t hash = 14695981039346656037ULL;
+    bench::result r = bench::run("directives", name, double(n), [&]() {
+        for (uint64_t i = 0; i < n; ++i) {
+            msg << Directive(i * 2654435761ULL);
+            digits += msg.otherId.size();
+            hash = hash_id(hash, msg.otherId);
+        }
+    });
+    std::cout << name << ": " << 1e9 / r.ns_per_op() << " ids/s, "
+              << r.allocs_per_op() << " allocs/id, "
+              << double(digits) / n << " digits/id" << std::endl;
+    msg << Directive(0);
+    hash = hash_id(hash, msg.otherId);
+    for (uint64_t power = 10; power <= std::numeric_limits<uint64_t>::max() / 10; power *= 10) {
+        msg << Directive(power - 1);
+        hash = hash_id(hash, msg.otherId);
+        msg << Directive(power);
+        hash = hash_id(hash, msg.otherId);
+    }
+    msg << Directive(std::numeric_limits<uint64_t>::max());
+    return hash_id(hash, msg.otherId);
+}
+
+int benchmark() {
+    const uint64_t n = 10000000;
+    uint64_t streamed = benchmark_id<ostringstream_id_directive>("ostringstream", n);
+    uint64_t converted = benchmark_id<id_directive>("to_chars     ", n);
+    std::cout << "ids " << (streamed == converted ? "identical" : "MISMATCH") << std::endl;
+    return streamed == converted ? 0 : 1;
 }
 
 // Encapsulation - by moving logic into the directive types the target object’s
@@ -139,7 +708,10 @@ inline OtherMessage& operator<<(OtherMessage& msg, const Directive& directive) {
 // because new directives are simply additive. The protocol is simple and can be
 // applied to a broad class of situations. In a header-only library, the static
 // nature of the wiring and chaining of the operations lends itself to compiler abuse.
-int main() {
+int main(int argc, char* argv[]) {
+    if (argc > 1 && std::string(argv[1]) == "bench") {
+        return benchmark();
+    }
 
     std::cout << "**** Message ****" << std::endl;
 
@@ -175,5 +747,78 @@ int main() {
     std::cout << "otherMsg.destination: " << otherMsg.destination << std::endl;
     std::cout << "otherMsg.otherId: " << otherMsg.otherId << std::endl;
 
+    std::cout << "**** owning directives ****" << std::endl;
+
+    // owns its string, so it can be kept and applied later
+    auto to_them = destination(std::string("them"));
+    msg << to_them;
+    otherMsg << source(std::string("us")) << std::move(to_them);
+
+    std::cout << "message.destination: " << msg.destination << std::endl;
+    std::cout << "otherMsg.source: " << otherMsg.source << std::endl;
+    std::cout << "otherMsg.destination: " << otherMsg.destination << std::endl;
+
+    std::cout << "**** MessageView ****" << std::endl;
+
+    const std::string me("me");
+    MessageView view;
+    view << source(me)
+         << destination("you")
+         << id(47ULL);
+
+    std::cout << "view.source: " << view.source << std::endl;
+    std::cout << "view.destination: " << view.destination << std::endl;
+    std::cout << "view.id: " << view.id << std::endl;
+
+    std::cout << "**** wire ****" << std::endl;
+
+    char storage[256];
+    wire_buffer buffer(storage, sizeof(storage));
+    msg << destination("wire") << write_to(buffer);
+    otherMsg << write_to(buffer);
+
+    MessageView decoded;
+    OtherMessageView otherDecoded;
+    std::size_t used = read_from(buffer.written(), decoded);
+    used += read_from(buffer.written().substr(used), otherDecoded);
+
+    std::cout << "wire.bytes: " << buffer.used << " decoded " << used << std::endl;
+    std::cout << "decoded.source: " << decoded.source << std::endl;
+    std::cout << "decoded.destination: " << decoded.destination << std::endl;
+    std::cout << "decoded.id: " << decoded.id << std::endl;
+    std::cout << "otherDecoded.otherId: " << otherDecoded.otherId << std::endl;
+
+    char small[8];
+    wire_buffer tooSmall(small, sizeof(small));
+    msg << write_to(tooSmall);
+    std::cout << "tooSmall.overflow: " << tooSmall.overflow << " used " << tooSmall.used << std::endl;
+
+    wire_iovecs iovecs;
+    otherMsg << gather_to(iovecs);
+    std::string gathered;
+    for (int i = 0; i < iovecs.count; ++i) {
+        gathered.append(static_cast<const char*>(iovecs.iov[i].iov_base), iovecs.iov[i].iov_len);
+    }
+    std::cout << "gathered: " << iovecs.count << " iovecs, "
+              << (gathered == buffer.written().substr(used - gathered.size()) ? "same" : "NOT the same")
+              << " as written" << std::endl;
+
+    std::cout << "**** batches ****" << std::endl;
+
+    Message messages[3];
+    apply_batch(messages, 3, directives(to_defaults(), destination("you")),
+                [](std::size_t i) { return id(100 + i); });
+    for (const Message& message : messages) {
+        std::cout << "messages: " << message.source << " " << message.destination << " "
+                  << message.id << std::endl;
+    }
+
+    MessageBatch batch(3);
+    batch << to_defaults() << destination("you") << ids(100);
+    for (std::size_t i = 0; i < batch.size(); ++i) {
+        std::cout << "batch: " << batch.source[i] << " " << batch.destination[i] << " "
+                  << batch.id[i] << std::endl;
+    }
+
     return 0;
 }
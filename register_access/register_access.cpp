@@ -1,145 +1,377 @@
 // https://yogiken.files.wordpress.com/2010/02/c-register-access.pdf
 
+#include "register_access.hpp"
+
 #include <cstdint>
 #include <iostream>
+#include <chrono>
+#include <string>
+#include <utility>
+#include <cstddef>
+#include <atomic>
+#include <thread>
+#include <vector>
+
+#include "bench.hpp"
 
 constexpr std::uint32_t cr_base(0xfffe0000);
 constexpr std::uint32_t mr_base(0xfffe0004);
 constexpr std::uint32_t sr_base(0xfffe0008);
 constexpr std::uint32_t reset_base(0xfffe0080);
+constexpr std::uint32_t gpio_base(0xfffe0100);
 
-template<unsigned long address, unsigned mask, unsigned offset, typename mutability_policy>
-struct reg_t {
-  static void write(unsigned value) {
-    mutability_policy::write(
-      reinterpret_cast<volatile unsigned*>(address), mask, offset, value);
+namespace hw {
+  namespace cr {
+    typedef reg_t<cr_base, 0x1, 0, wo_t> enable;
+    typedef reg_t<cr_base, 0x1, 1, wo_t> disable;
+    static_assert(register_map_t<enable, disable>::value, "hw::cr layout");
   }
-  static unsigned read() {
-    return mutability_policy::read(
-      reinterpret_cast<volatile unsigned*>(address), mask, offset);
+  namespace mr {
+    typedef reg_t<mr_base, 0xff, 0, rw_t> clockdiv;
+    typedef reg_t<mr_base, 0xf, 8, rw_t> delay;
+    static_assert(register_map_t<clockdiv, delay>::value, "hw::mr layout");
+    /** clockdiv and delay in one read-modify-write */
+    typedef transaction_t<clockdiv, delay> setup;
   }
-};
+  namespace sr {
+    typedef reg_t<sr_base, 0x1, 0, ro_t> enable;
+  }
+  namespace rst {
+    typedef reg_t<reset_base, 0x1, 0, keyed_wo_t<0xff, 24, 0xac> > reset;
+  }
+}
 
-/** writeonly policy */
-struct wo_t {
-  static void write(volatile unsigned* reg, unsigned mask, unsigned offset, unsigned value) {
-    *reg = (value & mask) << offset;
+// host executable example
+
+/**
+ * compile time readonly test: the field reads back all ones from a register
+ * with only its bits set and zero from one with all others set, checked by
+ * static_assert, run(true) only prints the values checked
+ */
+template<unsigned mask, unsigned offset>
+struct ro_static_test_t {
+  typedef field_t<mask, offset> field;
+  static constexpr unsigned on = soft_ro_t<mask << offset>::template read<field>(nullptr);
+  static constexpr unsigned off = soft_ro_t<~(mask << offset)>::template read<field>(nullptr);
+  static_assert(on == mask, "field reads back all ones");
+  static_assert(off == 0, "field reads back zero");
+  static void run(bool print) {
+    if (print) {
+      std::cout << on << " : " << mask << std::endl;
+      std::cout << off << std::endl;
+    }
   }
 };
 
-/** readonly policy */
-struct ro_t {
-  static unsigned read(volatile unsigned* reg, unsigned mask, unsigned offset) {
-    return (*reg >> offset) & mask;
-  }
+/**
+ * test generator
+ * Every contiguous mask of 1 to 32 bits at every offset it fits, masks
+ * ascending, offsets descending. Test case i is computed by a constexpr
+ * function and all test cases are expanded from one index_sequence, instead
+ * of nested recursive instantiations.
+ */
+
+struct test_case_t {
+  unsigned mask;
+  unsigned offset;
 };
 
-/** read/write policy */
-struct rw_t : public ro_t {
-  static void write(volatile unsigned* reg, unsigned mask, unsigned offset, unsigned value) {
-    *reg = (*reg & ~(mask << offset)) | ((value & mask) << offset);
+/** a mask of bits bits fits at 33 - bits offsets */
+constexpr std::size_t test_count() {
+  std::size_t n = 0;
+  for (unsigned bits = 1; bits <= 32; ++bits) {
+    n += 33 - bits;
   }
-};
+  return n;
+}
 
-/** password protected writeonly policy */
-template<unsigned key_mask, unsigned key_offset, unsigned key_value>
-struct keyed_wo_t {
-  static void write(volatile unsigned* reg, unsigned mask, unsigned offset, unsigned value) {
-    volatile unsigned tmp = (value & mask) << offset;
-    tmp &= ~(key_mask << key_offset);
-    tmp |= (key_value & key_mask) << key_offset;
-    *reg = tmp;
+constexpr test_case_t test_case(std::size_t i) {
+  unsigned bits = 1;
+  while (i > 32 - bits) {
+    i -= 33 - bits;
+    ++bits;
+  }
+  return test_case_t{bits == 32 ? 0xffffffffu : (1u << bits) - 1,
+                     unsigned(32 - bits - i)};
+}
+
+template<template <unsigned, unsigned> class test>
+struct generate_tests_t {
+  /** calls every test's run(args...) */
+  template<typename... args>
+  static void run(args... arg) {
+    run(std::make_index_sequence<test_count()>(), arg...);
+  }
+
+private:
+  template<std::size_t... i, typename... args>
+  static void run(std::index_sequence<i...>, args... arg) {
+    (test<test_case(i).mask, test_case(i).offset>::run(arg...), ...);
   }
 };
 
-/** readonly test policy */
-template<unsigned initialized_to>
-struct soft_ro_t {
-  static unsigned read(unsigned volatile* reg, unsigned mask, unsigned offset) {
-    (void) reg;
-    unsigned volatile soft_register = initialized_to;
-    return ro_t::read(&soft_register, mask, offset);
+
+/** shadow register test, write back so the hardware is never touched */
+struct shadow_test_t {
+  static void run() {
+    typedef shadow_t<0, 0xf0, write_back_t> shadow;
+    typedef reg_t<0, 0xf, 0, shadow> low;
+    typedef reg_t<0, 0xf, 4, shadow> high;
+    low::write(0x5);
+    std::cout << "shadow: " << high::read() << " " << low::read()
+              << " value " << shadow::value()
+              << " pending " << shadow::pending() << std::endl;
   }
 };
 
+/**
+ * the same on the register file, where flush() can store and sync() load,
+ * false if either misses the simulated register
+ */
+struct sim_shadow_test_t {
+  static bool run() {
+    const unsigned long address = 0x10;
+    typedef sim_t<shadow_t<address, 0xf0, write_back_t> > shadow;
+    typedef reg_t<address, 0xf, 0, shadow> low;
+    register_file_t& file = register_file_t::instance();
+    file.clear();
+    low::write(0x5);
+    bool ok = file.word(address) == 0 && file.writes == 0;
+    shadow::flush();
+    ok &= file.word(address) == 0xf5 && file.writes == 1;
+    file.word(address) = 0x3c;
+    shadow::sync();
+    ok &= low::read() == 0xc && file.reads == 1;
+    std::cout << "sim shadow: flushed and synced" << (ok ? "" : " MISMATCH") << std::endl;
+    return ok;
+  }
+};
 
-namespace hw {
+/**
+ * Simulated drivers register map, same layout as hw but run on the register
+ * file
+ */
+namespace sim {
   namespace cr {
-    typedef reg_t<cr_base, 0x1, 0, wo_t> enable;
-    typedef reg_t<cr_base, 0x1, 1, wo_t> disable;
+    typedef reg_t<cr_base, 0x1, 0, sim_t<wo_t> > enable;
   }
   namespace mr {
-    typedef reg_t<mr_base, 0xff, 0, rw_t> clockdiv;
-    typedef reg_t<mr_base, 0xf, 8, rw_t> delay;
+    typedef reg_t<mr_base, 0xff, 0, sim_t<rw_t> > clockdiv;
+    typedef reg_t<mr_base, 0xf, 8, sim_t<rw_t> > delay;
+    typedef transaction_t<clockdiv, delay> setup;
+    typedef reg_t<mr_base, 0xff, 0, sim_t<shadow_t<mr_base> > > shadowed_clockdiv;
   }
   namespace sr {
-    typedef reg_t<sr_base, 0x1, 0, ro_t> enable;
+    typedef reg_t<sr_base, 0x1, 0, sim_t<ro_t> > enable;
   }
   namespace rst {
-    typedef reg_t<reset_base, 0x1, 0, keyed_wo_t<0xff, 24, 0xac> > reset;
+    typedef reg_t<reset_base, 0x1, 0, sim_t<keyed_wo_t<0xff, 24, 0xac> > > reset;
+  }
+  namespace gpio {
+    /** output register with set alias at +0x4 and clear alias at +0x8 */
+    typedef set_clear_t<0x4, 0x8> aliases;
+    typedef reg_t<gpio_base, 0x1, 0, sim_t<aliases> > led;
+    typedef reg_t<gpio_base, 0xff, 8, sim_t<aliases> > port;
+    typedef reg_t<gpio_base, 0x1, 16, sim_t<atomic_rw_t> > atomic_led;
+    typedef reg_t<gpio_base, 0xff, 24, sim_t<atomic_rw_t> > atomic_port;
   }
 }
 
-// host executable example
+/**
+ * Runs op n times against the register file, prints bus accesses and ns per
+ * op. Returns false if the access counts differ from the expected ones.
+ */
+template<typename op>
+bool benchmark_op(const char* name, unsigned long reads, unsigned long writes, op f) {
+  const unsigned n = 1000000;
+  register_file_t& file = register_file_t::instance();
+  file.clear();
+  bench::result r = bench::run("register_access", name, n, [f]() {
+    for (unsigned i = 0; i < n; ++i) {
+      f(i);
+    }
+  });
+  bool ok = file.reads == reads * n && file.writes == writes * n;
+  std::cout << name << ": "
+            << double(file.reads) / n << " reads/op, "
+            << double(file.writes) / n << " writes/op, "
+            << r.ns_per_op() << " ns/op" << (ok ? "" : " ACCESS COUNT REGRESSION") << std::endl;
+  return ok;
+}
 
-/** readonly test */
-template<unsigned mask, unsigned offset>
-struct ro_test_t {
-  static void run() {
-    typedef reg_t<0, mask, offset, soft_ro_t<mask << offset> > on;
-    std::cout << on::read() << " : " << mask << std::endl;
-    typedef reg_t<0, mask, offset, soft_ro_t<~(mask << offset)> > off;
-    std::cout << off::read() << std::endl;
+struct wo_op { void operator()(unsigned i) const { sim::cr::enable::write(i); } };
+struct ro_op { void operator()(unsigned) const { (void) sim::sr::enable::read(); } };
+struct rw_op { void operator()(unsigned i) const { sim::mr::clockdiv::write(i); } };
+struct rw_two_fields_op {
+  void operator()(unsigned i) const {
+    sim::mr::clockdiv::write(i);
+    sim::mr::delay::write(i);
   }
 };
+struct transaction_op { void operator()(unsigned i) const { sim::mr::setup::write(i, i); } };
+struct shadow_op { void operator()(unsigned i) const { sim::mr::shadowed_clockdiv::write(i); } };
+struct keyed_wo_op { void operator()(unsigned) const { sim::rst::reset::write(1); } };
+struct set_clear_bit_op { void operator()(unsigned i) const { sim::gpio::led::write(i); } };
+struct set_clear_op { void operator()(unsigned) const { sim::gpio::port::write(0x5a); } };
+struct atomic_rw_bit_op { void operator()(unsigned) const { sim::gpio::atomic_led::write(1); } };
+struct atomic_rw_op { void operator()(unsigned) const { sim::gpio::atomic_port::write(0x5a); } };
 
-/** test generator */
-
-template<unsigned mask>
-struct num_shifts_t {
-  static const unsigned value = 1 + num_shifts_t<(mask << 1) | 1>::value;
-};
-template<>
-struct num_shifts_t<0xffffffff> {
-  static const unsigned value = 0;
-};
+/** ns per register of f(), run rounds times over n registers */
+template<typename op>
+double ns_per_register(const char* name, std::size_t n, unsigned rounds, op f) {
+  return bench::run("register_access", name, double(n) * rounds, [&f, rounds]() {
+    for (unsigned round = 0; round < rounds; ++round) {
+      f();
+    }
+  }).ns_per_op();
+}
 
-template<template <unsigned, unsigned> class test, unsigned mask, unsigned offset>
-struct generate_offsets_t {
-  static void run() {
-    test<mask, offset>::run();
-    generate_offsets_t<test, mask, offset-1>::run();
+/**
+ * Decodes and patches hw::mr::delay across a register dump, one ro_t::read
+ * or rw_t::write per register through a volatile pointer as a reg_t would,
+ * against the bulk kernels. Returns false if the results differ.
+ */
+bool benchmark_bulk() {
+  typedef hw::mr::delay reg;
+  typedef reg::field field;
+  const std::size_t n = 1 << 20;
+  const unsigned rounds = 16;
+  std::vector<unsigned> dump(n);
+  for (std::size_t i = 0; i < n; ++i) {
+    dump[i] = unsigned(i) * 2654435761u;
   }
-};
-template<template <unsigned, unsigned> class test, unsigned mask>
-struct generate_offsets_t<test, mask, 0> {
-  static void run() {
-    test<mask, 0>::run();
+  std::vector<unsigned> expected(n), scalar_values(n), simd_values(n);
+  double per_read = ns_per_register("bulk extract, ro_t::read", n, rounds, [&]() {
+    for (std::size_t i = 0; i < n; ++i) {
+      const volatile unsigned* r = &dump[i];
+      expected[i] = ro_t::read<field>(r);
+    }
+  });
+  double scalar = ns_per_register("bulk extract, scalar", n, rounds, [&]() {
+    bulk::extract_scalar<reg>(dump.data(), scalar_values.data(), n);
+  });
+  double vector = ns_per_register("bulk extract, simd", n, rounds, [&]() {
+    bulk::extract<reg>(dump.data(), simd_values.data(), n);
+  });
+  bool ok = scalar_values == expected && simd_values == expected;
+  std::cout << "bulk extract         : ro_t::read " << per_read << ", scalar " << scalar
+            << ", simd " << vector << " ns/register" << (ok ? "" : " MISMATCH") << std::endl;
+
+  // every kernel patches its own copy of the dump, inserting the same
+  // values each round, so the copies have to end up equal
+  std::vector<unsigned> values(n);
+  for (std::size_t i = 0; i < n; ++i) {
+    values[i] = unsigned(i);
   }
-};
+  std::vector<unsigned> written(dump), scalar_patched(dump), simd_patched(dump);
+  per_read = ns_per_register("bulk insert, rw_t::write", n, rounds, [&]() {
+    for (std::size_t i = 0; i < n; ++i) {
+      volatile unsigned* r = &written[i];
+      rw_t::write<field>(r, values[i]);
+    }
+  });
+  scalar = ns_per_register("bulk insert, scalar", n, rounds, [&]() {
+    bulk::insert_scalar<reg>(scalar_patched.data(), values.data(), n);
+  });
+  vector = ns_per_register("bulk insert, simd", n, rounds, [&]() {
+    bulk::insert<reg>(simd_patched.data(), values.data(), n);
+  });
+  bool inserted = scalar_patched == written && simd_patched == written;
+  std::cout << "bulk insert          : rw_t::write " << per_read << ", scalar " << scalar
+            << ", simd " << vector << " ns/register" << (inserted ? "" : " MISMATCH") << std::endl;
+  return ok && inserted;
+}
 
-template<template <unsigned, unsigned> class test, unsigned mask>
-struct generate_masks_t {
-  static void run() {
-    generate_offsets_t<test, mask, num_shifts_t<mask>::value>::run();
-    generate_masks_t<test, (mask << 1) | 1>::run();
+int benchmark() {
+  bool ok = true;
+  ok &= benchmark_op("wo_t write          ", 0, 1, wo_op());
+  ok &= benchmark_op("ro_t read           ", 1, 0, ro_op());
+  ok &= benchmark_op("rw_t write          ", 1, 1, rw_op());
+  ok &= benchmark_op("rw_t two fields     ", 2, 2, rw_two_fields_op());
+  ok &= benchmark_op("rw_t transaction    ", 1, 1, transaction_op());
+  ok &= benchmark_op("shadow_t write      ", 0, 1, shadow_op());
+  ok &= benchmark_op("keyed_wo_t write    ", 0, 1, keyed_wo_op());
+  // one bit is either set or cleared, other values both
+  ok &= benchmark_op("set_clear_t bit     ", 0, 1, set_clear_bit_op());
+  ok &= benchmark_op("set_clear_t write   ", 0, 2, set_clear_op());
+  // fetch_or, or load and one compare-exchange without contention
+  ok &= benchmark_op("atomic_rw_t bit     ", 1, 1, atomic_rw_bit_op());
+  ok &= benchmark_op("atomic_rw_t write   ", 2, 1, atomic_rw_op());
+  ok &= benchmark_bulk();
+  return ok ? 0 : 1;
+}
+
+/**
+ * atomic policy test: one thread per byte of the same word, each writing its
+ * own field over and over. Every field has to end with its writer's last
+ * value, a plain rw_t read-modify-write would lose updates.
+ */
+template<unsigned byte>
+struct atomic_writer_t {
+  typedef field_t<0xff, 8 * byte> field;
+  static void run(volatile unsigned* word, unsigned n) {
+    for (unsigned i = 1; i <= n; ++i) {
+      atomic_rw_t::write<field>(word, i + byte);
+    }
   }
 };
-template<template <unsigned, unsigned> class test>
-struct generate_masks_t<test, 0xffffffff> {
-  static void run() {
-    generate_offsets_t<test, 0xffffffff, num_shifts_t<0xffffffff>::value>::run();
+
+struct atomic_test_t {
+  /** false if an update got lost */
+  static bool run() {
+    const unsigned n = 100000;
+    alignas(std::atomic_ref<unsigned>::required_alignment) unsigned word = 0;
+    volatile unsigned* reg = &word;
+    std::thread writers[] = {
+      std::thread([reg]() { atomic_writer_t<0>::run(reg, n); }),
+      std::thread([reg]() { atomic_writer_t<1>::run(reg, n); }),
+      std::thread([reg]() { atomic_writer_t<2>::run(reg, n); }),
+      std::thread([reg]() { atomic_writer_t<3>::run(reg, n); })
+    };
+    for (std::thread& writer : writers) {
+      writer.join();
+    }
+    unsigned expected = 0;
+    for (unsigned byte = 0; byte < 4; ++byte) {
+      expected |= ((n + byte) & 0xff) << (8 * byte);
+    }
+    bool ok = word == expected;
+    std::cout << "atomic: " << std::hex << word << " expected " << expected
+              << std::dec << (ok ? "" : " LOST UPDATE") << std::endl;
+    return ok;
   }
 };
 
-template<template <unsigned, unsigned> class test>
-struct generate_tests_t {
-  static void run() {
-    generate_masks_t<test, 0x1>::run();
+/**
+ * set/clear test on the register file: the base register reads back what the
+ * alias writes set and cleared, false otherwise
+ */
+struct sim_set_clear_test_t {
+  static bool run() {
+    register_file_t& file = register_file_t::instance();
+    file.clear();
+    file.word(gpio_base) = 0xffffffff;
+    sim::gpio::port::write(0x5a);
+    bool ok = sim::gpio::port::read() == 0x5a && file.word(gpio_base) == 0xffff5aff;
+    sim::gpio::led::write(0);
+    ok &= sim::gpio::led::read() == 0 && file.word(gpio_base) == 0xffff5afe;
+    ok &= file.writes == 3;
+    std::cout << "sim set/clear: " << std::hex << file.word(gpio_base) << std::dec
+              << (ok ? "" : " MISMATCH") << std::endl;
+    return ok;
   }
 };
 
-
-int main() {
-  generate_tests_t<ro_test_t>::run();
+int main(int argc, char* argv[]) {
+  if (argc > 1 && std::string(argv[1]) == "bench") {
+    return benchmark();
+  }
+  // checked while compiling, "print" shows the values checked
+  std::cout << test_count() << " readonly tests passed at compile time" << std::endl;
+  generate_tests_t<ro_static_test_t>::run(argc > 1 && std::string(argv[1]) == "print");
+  shadow_test_t::run();
+  bool ok = sim_shadow_test_t::run();
+  ok &= sim_set_clear_test_t::run();
+  ok &= atomic_test_t::run();
+  return ok ? 0 : 1;
 }
@@ -0,0 +1,610 @@
+// https://yogiken.files.wordpress.com/2010/02/c-register-access.pdf
+//
+// Register access: fields, mutability policies, register maps, transactions
+// and the simulated register file. The host example and tests are in
+// register_access.cpp.
+
+#ifndef REGISTER_ACCESS_HPP
+#define REGISTER_ACCESS_HPP
+
+#include <cstdint>
+#include <cstddef>
+#include <type_traits>
+#include <unordered_map>
+#include <vector>
+#include <atomic>
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+/**
+ * Field layout
+ * Validates a mask/offset pair at compile time and precomputes everything the
+ * policies need, so their accesses compile to and/or/shift with immediates.
+ */
+template<unsigned mask, unsigned offset>
+struct field_t {
+  static_assert(mask != 0, "field without bits");
+  static_assert(offset < 32, "field offset beyond the register");
+  static_assert(((mask << offset) >> offset) == mask, "field exceeds the register");
+
+  static constexpr unsigned value_mask = mask;
+  static constexpr unsigned shift = offset;
+  static constexpr unsigned shifted_mask = mask << offset;
+  static constexpr unsigned inverted_mask = ~shifted_mask;
+
+  /** value moved into its place in the register */
+  static constexpr unsigned insert(unsigned value) {
+    return (value & value_mask) << shift;
+  }
+  /** field value out of a register value */
+  static constexpr unsigned extract(unsigned reg) {
+    return (reg >> shift) & value_mask;
+  }
+};
+
+template<unsigned long address, unsigned mask, unsigned offset, typename mutability_policy>
+struct reg_t {
+  typedef field_t<mask, offset> field;
+  typedef mutability_policy policy;
+  static constexpr unsigned long reg_address = address;
+
+  static void write(unsigned value) {
+    mutability_policy::template write<field>(
+      reinterpret_cast<volatile unsigned*>(address), value);
+  }
+  static unsigned read() {
+    return mutability_policy::template read<field>(
+      reinterpret_cast<volatile unsigned*>(address));
+  }
+};
+
+/**
+ * Write capable policies also offer write_bits, writing the already shifted
+ * bits of all fields in field_mask at once. That is what transaction_t uses.
+ * Policies access the register through any pointer-like reg_ptr, that is
+ * how sim_t redirects them to the simulated register file.
+ */
+
+/** writeonly policy */
+struct wo_t {
+  template<typename field, typename reg_ptr>
+  static void write(reg_ptr reg, unsigned value) {
+    write_bits<field::shifted_mask>(reg, field::insert(value));
+  }
+  template<unsigned field_mask, typename reg_ptr>
+  static void write_bits(reg_ptr reg, unsigned bits) {
+    *reg = bits;
+  }
+};
+
+/** readonly policy */
+struct ro_t {
+  template<typename field, typename reg_ptr>
+  static constexpr unsigned read(reg_ptr reg) {
+    return field::extract(*reg);
+  }
+};
+
+/** read/write policy */
+struct rw_t : public ro_t {
+  template<typename field, typename reg_ptr>
+  static void write(reg_ptr reg, unsigned value) {
+    write_bits<field::shifted_mask>(reg, field::insert(value));
+  }
+  /** a single store if every bit is written, read-modify-write otherwise */
+  template<unsigned field_mask, typename reg_ptr>
+  static void write_bits(reg_ptr reg, unsigned bits) {
+    if (field_mask == ~0u) {
+      *reg = bits;
+    } else {
+      *reg = (*reg & ~field_mask) | bits;
+    }
+  }
+};
+
+/** password protected writeonly policy */
+template<unsigned key_mask, unsigned key_offset, unsigned key_value>
+struct keyed_wo_t {
+  typedef field_t<key_mask, key_offset> key;
+
+  template<typename field, typename reg_ptr>
+  static void write(reg_ptr reg, unsigned value) {
+    write_bits<field::shifted_mask>(reg, field::insert(value));
+  }
+  template<unsigned field_mask, typename reg_ptr>
+  static void write_bits(reg_ptr reg, unsigned bits) {
+    static_assert((field_mask & key::shifted_mask) == 0, "field overlaps the key");
+    *reg = (bits & key::inverted_mask) | key::insert(key_value);
+  }
+};
+
+/**
+ * Stores bits to the write-one-to-set / write-one-to-clear alias offset
+ * bytes past reg. Overloaded for every reg_ptr the set/clear policy takes.
+ */
+inline volatile unsigned* register_offset(volatile unsigned* reg, unsigned long bytes) {
+  return reinterpret_cast<volatile unsigned*>(reinterpret_cast<unsigned long>(reg) + bytes);
+}
+inline void write_set_alias(volatile unsigned* reg, unsigned long offset, unsigned bits) {
+  *register_offset(reg, offset) = bits;
+}
+inline void write_clear_alias(volatile unsigned* reg, unsigned long offset, unsigned bits) {
+  *register_offset(reg, offset) = bits;
+}
+
+/**
+ * Atomic view of the register, std::atomic_ref or anything offering the same
+ * load/store/fetch_or/fetch_and/compare_exchange_weak. Overloaded for every
+ * reg_ptr the atomic policy takes.
+ * atomic_ref can't be volatile, atomic operations aren't elided anyway.
+ */
+inline std::atomic_ref<unsigned> atomic_register(volatile unsigned* reg) {
+  return std::atomic_ref<unsigned>(const_cast<unsigned&>(*reg));
+}
+
+/**
+ * Set/clear alias policy
+ * For hardware mirroring a register with write-one-to-set and
+ * write-one-to-clear aliases at address + set_offset / + clear_offset.
+ * A field write is at most one store to each alias and never a read, every
+ * store is atomic on the bus: concurrent writers of other fields can't
+ * clobber each other, no lock and no interrupt disable needed.
+ * The field briefly reads as cleared between the two stores.
+ */
+template<unsigned long set_offset, unsigned long clear_offset>
+struct set_clear_t : public ro_t {
+  template<typename field, typename reg_ptr>
+  static void write(reg_ptr reg, unsigned value) {
+    write_bits<field::shifted_mask>(reg, field::insert(value));
+  }
+  template<unsigned field_mask, typename reg_ptr>
+  static void write_bits(reg_ptr reg, unsigned bits) {
+    unsigned clear = field_mask & ~bits;
+    if (clear) {
+      write_clear_alias(reg, clear_offset, clear);
+    }
+    if (bits) {
+      write_set_alias(reg, set_offset, bits);
+    }
+  }
+};
+
+/**
+ * Atomic read/write policy
+ * Read-modify-write through std::atomic_ref, for registers (or RAM shared
+ * between cores) where the bus supports atomic accesses. Single bit updates
+ * and all-ones/all-zeros fields are one fetch_or/fetch_and, other values a
+ * compare-exchange loop. Fields on different bits of the same register can
+ * be written concurrently from any core without a global lock.
+ */
+struct atomic_rw_t {
+  template<typename field, typename reg_ptr>
+  static unsigned read(reg_ptr reg) {
+    return field::extract(atomic_register(reg).load());
+  }
+  template<typename field, typename reg_ptr>
+  static void write(reg_ptr reg, unsigned value) {
+    write_bits<field::shifted_mask>(reg, field::insert(value));
+  }
+  template<unsigned field_mask, typename reg_ptr>
+  static void write_bits(reg_ptr reg, unsigned bits) {
+    auto word = atomic_register(reg);
+    if (field_mask == ~0u) {
+      word.store(bits);
+    } else if (bits == field_mask) {
+      word.fetch_or(bits);
+    } else if (bits == 0) {
+      word.fetch_and(~field_mask);
+    } else {
+      unsigned expected = word.load(std::memory_order_relaxed);
+      while (!word.compare_exchange_weak(expected, (expected & ~field_mask) | bits)) {
+      }
+    }
+  }
+};
+
+/**
+ * Shadow register policy
+ * Keeps a copy of the register at address in RAM. Reads and the merge of a
+ * field write are served from that copy, only writes reach the hardware:
+ * no read before a write, and write only registers can be read back.
+ * write_through_t stores every write right away, write_back_t only marks
+ * the shadow dirty until flush(). Meant for registers holding state, not for
+ * strobe/command bits, as the shadow writes every field's last value again.
+ * sync() reloads the shadow from a readable register. Both take the
+ * register like the accesses do, the overloads without one go to address,
+ * sim_t forwards its own.
+ */
+struct write_through_t {};
+struct write_back_t {};
+
+template<unsigned long address, unsigned reset_value = 0, typename sync_mode = write_through_t>
+struct shadow_t {
+  static constexpr unsigned long reg_address = address;
+
+  template<typename field, typename reg_ptr>
+  static unsigned read(reg_ptr reg) {
+    (void) reg;
+    return field::extract(shadow);
+  }
+  template<typename field, typename reg_ptr>
+  static void write(reg_ptr reg, unsigned value) {
+    write_bits<field::shifted_mask>(reg, field::insert(value));
+  }
+  template<unsigned field_mask, typename reg_ptr>
+  static void write_bits(reg_ptr reg, unsigned bits) {
+    shadow = (shadow & ~field_mask) | bits;
+    if (std::is_same<sync_mode, write_back_t>::value) {
+      dirty = true;
+    } else {
+      *reg = shadow;
+    }
+  }
+  /** stores the shadow if written since the last flush */
+  template<typename reg_ptr>
+  static void flush(reg_ptr reg) {
+    if (dirty) {
+      *reg = shadow;
+      dirty = false;
+    }
+  }
+  static void flush() { flush(hardware()); }
+  /** replaces the shadow by the register's value, dropping pending writes */
+  template<typename reg_ptr>
+  static void sync(reg_ptr reg) {
+    shadow = *reg;
+    dirty = false;
+  }
+  static void sync() { sync(hardware()); }
+  static unsigned value() { return shadow; }
+  static bool pending() { return dirty; }
+
+private:
+  static volatile unsigned* hardware() {
+    return reinterpret_cast<volatile unsigned*>(address);
+  }
+  static unsigned shadow;
+  static bool dirty;
+};
+template<unsigned long address, unsigned reset_value, typename sync_mode>
+unsigned shadow_t<address, reset_value, sync_mode>::shadow = reset_value;
+template<unsigned long address, unsigned reset_value, typename sync_mode>
+bool shadow_t<address, reset_value, sync_mode>::dirty = false;
+
+/**
+ * Simulated register file
+ * Memory backed storage for any register address, created zero on first
+ * access, and counters of all simulated bus reads and writes.
+ * Address ranges can be backed by caller owned words instead (attach), e.g.
+ * by a register image, without copying.
+ * The counters may be bumped from any thread, but word() creates registers:
+ * touch every register once before threads share the file.
+ */
+class register_file_t {
+public:
+  static register_file_t& instance() {
+    static register_file_t file;
+    return file;
+  }
+  unsigned& word(unsigned long address) {
+    for (std::size_t i = 0; i < windows.size(); ++i) {
+      const window_t& w = windows[i];
+      if (address >= w.base && address - w.base < w.count * sizeof(unsigned)) {
+        return w.words[(address - w.base) / sizeof(unsigned)];
+      }
+    }
+    return words[address];
+  }
+  /** count registers from base on live in words */
+  void attach(unsigned long base, unsigned* storage, std::size_t count) {
+    window_t w = {base, storage, count};
+    windows.push_back(w);
+  }
+  void clear() { words.clear(); windows.clear(); reset_counters(); }
+  void reset_counters() { reads = 0; writes = 0; }
+  std::atomic<unsigned long> reads;
+  std::atomic<unsigned long> writes;
+
+private:
+  struct window_t {
+    unsigned long base;
+    unsigned* words;
+    std::size_t count;
+  };
+  register_file_t() : reads(0), writes(0) {}
+  std::unordered_map<unsigned long, unsigned> words;
+  std::vector<window_t> windows;
+};
+
+/** one simulated bus access, counted */
+struct sim_word_t {
+  unsigned* word;
+  operator unsigned() const {
+    ++register_file_t::instance().reads;
+    return *word;
+  }
+  sim_word_t& operator=(unsigned value) {
+    ++register_file_t::instance().writes;
+    *word = value;
+    return *this;
+  }
+};
+
+/** pointer-like register access into the register file */
+struct sim_ptr_t {
+  unsigned* word;
+  sim_word_t operator*() const { sim_word_t w = {word}; return w; }
+};
+
+/**
+ * The simulated aliases act on the register itself, one counted write each,
+ * so reading it back shows what a set or clear did
+ */
+inline void write_set_alias(sim_ptr_t reg, unsigned long, unsigned bits) {
+  ++register_file_t::instance().writes;
+  *reg.word |= bits;
+}
+inline void write_clear_alias(sim_ptr_t reg, unsigned long, unsigned bits) {
+  ++register_file_t::instance().writes;
+  *reg.word &= ~bits;
+}
+
+/**
+ * Atomic access to a simulated word, counted as the bus would see it: a
+ * read-modify-write is one read and one write, a failed compare-exchange
+ * only a read.
+ */
+struct sim_atomic_t {
+  std::atomic_ref<unsigned> word;
+  unsigned load(std::memory_order order = std::memory_order_seq_cst) const {
+    ++register_file_t::instance().reads;
+    return word.load(order);
+  }
+  void store(unsigned value) const {
+    ++register_file_t::instance().writes;
+    word.store(value);
+  }
+  unsigned fetch_or(unsigned bits) const {
+    ++register_file_t::instance().reads;
+    ++register_file_t::instance().writes;
+    return word.fetch_or(bits);
+  }
+  unsigned fetch_and(unsigned bits) const {
+    ++register_file_t::instance().reads;
+    ++register_file_t::instance().writes;
+    return word.fetch_and(bits);
+  }
+  bool compare_exchange_weak(unsigned& expected, unsigned desired) const {
+    ++register_file_t::instance().reads;
+    bool exchanged = word.compare_exchange_weak(expected, desired);
+    if (exchanged) {
+      ++register_file_t::instance().writes;
+    }
+    return exchanged;
+  }
+};
+
+inline sim_atomic_t atomic_register(sim_ptr_t reg) {
+  sim_atomic_t atomic = {std::atomic_ref<unsigned>(*reg.word)};
+  return atomic;
+}
+
+/**
+ * Simulation policy
+ * Runs policy against the register file instead of the hardware address, so
+ * drivers built on reg_t run on the host unchanged but for the policy.
+ */
+template<typename policy>
+struct sim_t {
+  template<typename field>
+  static unsigned read(volatile unsigned* reg) {
+    return policy::template read<field>(map(reg));
+  }
+  template<typename field>
+  static void write(volatile unsigned* reg, unsigned value) {
+    policy::template write<field>(map(reg), value);
+  }
+  template<unsigned field_mask>
+  static void write_bits(volatile unsigned* reg, unsigned bits) {
+    policy::template write_bits<field_mask>(map(reg), bits);
+  }
+  /** flush() and sync() of a shadow_t, on its simulated register */
+  static void flush() {
+    policy::flush(map(reinterpret_cast<volatile unsigned*>(policy::reg_address)));
+  }
+  static void sync() {
+    policy::sync(map(reinterpret_cast<volatile unsigned*>(policy::reg_address)));
+  }
+
+private:
+  static sim_ptr_t map(volatile unsigned* reg) {
+    sim_ptr_t ptr = {&register_file_t::instance().word(reinterpret_cast<unsigned long>(reg))};
+    return ptr;
+  }
+};
+
+/** readonly test policy, usable in constant expressions */
+template<unsigned initialized_to>
+struct soft_ro_t {
+  template<typename field, typename reg_ptr>
+  static constexpr unsigned read(reg_ptr reg) {
+    (void) reg;
+    unsigned soft_register = initialized_to;
+    return ro_t::read<field>(&soft_register);
+  }
+};
+
+
+/**
+ * Register map
+ * Fields declared for the same register are checked at compile time: same
+ * address, same policy and no two fields sharing a bit.
+ * static_assert(register_map_t<clockdiv, delay>::value, "...") next to the
+ * field declarations keeps a layout from silently going wrong.
+ */
+template<typename... regs>
+struct fields_t;
+
+template<>
+struct fields_t<> {
+  static constexpr unsigned field_mask = 0;
+  static constexpr bool disjoint = true;
+  static constexpr unsigned bits() { return 0; }
+  template<unsigned long address, typename policy>
+  struct same_register_t {
+    static constexpr bool value = true;
+  };
+};
+
+template<typename reg, typename... regs>
+struct fields_t<reg, regs...> {
+  static constexpr unsigned field_mask =
+    reg::field::shifted_mask | fields_t<regs...>::field_mask;
+  static constexpr bool disjoint =
+    (reg::field::shifted_mask & fields_t<regs...>::field_mask) == 0 &&
+    fields_t<regs...>::disjoint;
+
+  template<typename... values>
+  static constexpr unsigned bits(unsigned value, values... rest) {
+    return reg::field::insert(value) | fields_t<regs...>::bits(rest...);
+  }
+
+  template<unsigned long address, typename policy>
+  struct same_register_t {
+    static constexpr bool value = reg::reg_address == address &&
+      std::is_same<typename reg::policy, policy>::value &&
+      fields_t<regs...>::template same_register_t<address, policy>::value;
+  };
+};
+
+template<typename reg, typename... regs>
+struct register_map_t {
+  typedef fields_t<reg, regs...> fields;
+  static_assert(fields::template
+                  same_register_t<reg::reg_address, typename reg::policy>::value,
+                "fields of one register have to share address and policy");
+  static_assert(fields::disjoint, "fields of one register overlap");
+  static constexpr bool value = true;
+};
+
+/**
+ * Register transaction
+ * Writes several fields of the same register with a single bus access:
+ * transaction_t<clockdiv, delay>::write(div, dly) merges both fields into
+ * one read-modify-write for rw_t, or into one plain store if the fields
+ * cover the whole register or the policy is write only anyway.
+ * Combined mask and field layout are resolved at compile time.
+ */
+template<typename reg, typename... regs>
+struct transaction_t {
+  static_assert(register_map_t<reg, regs...>::value, "invalid transaction");
+
+  typedef fields_t<reg, regs...> fields;
+
+  /** one value per field, in the order of the fields */
+  template<typename... values>
+  static void write(values... value) {
+    static_assert(sizeof...(values) == 1 + sizeof...(regs), "one value per field");
+    reg::policy::template write_bits<fields::field_mask>(
+      reinterpret_cast<volatile unsigned*>(reg::reg_address), fields::bits(value...));
+  }
+};
+
+/**
+ * Bulk field access
+ * Extracts or inserts the field of reg from/into a whole array of register
+ * snapshots, e.g. a captured register dump, with the same mask and offset as
+ * ro_t::read and rw_t::write. The kernels use AVX2, SSE2 or NEON, whatever
+ * the target is compiled for, and finish the tail with the scalar versions.
+ */
+namespace bulk {
+  template<typename reg>
+  void extract_scalar(const unsigned* regs, unsigned* values, std::size_t n) {
+    for (std::size_t i = 0; i < n; ++i) {
+      values[i] = reg::field::extract(regs[i]);
+    }
+  }
+
+  /** read-modify-write of the field in every register, as rw_t does */
+  template<typename reg>
+  void insert_scalar(unsigned* regs, const unsigned* values, std::size_t n) {
+    for (std::size_t i = 0; i < n; ++i) {
+      regs[i] = (regs[i] & reg::field::inverted_mask) | reg::field::insert(values[i]);
+    }
+  }
+
+  template<typename reg>
+  void extract(const unsigned* regs, unsigned* values, std::size_t n) {
+    std::size_t i = 0;
+#if defined(__AVX2__)
+    typedef typename reg::field field;
+    const __m256i mask = _mm256_set1_epi32(int(field::value_mask));
+    for (; i + 8 <= n; i += 8) {
+      __m256i r = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(regs + i));
+      r = _mm256_and_si256(_mm256_srli_epi32(r, field::shift), mask);
+      _mm256_storeu_si256(reinterpret_cast<__m256i*>(values + i), r);
+    }
+#elif defined(__SSE2__)
+    typedef typename reg::field field;
+    const __m128i mask = _mm_set1_epi32(int(field::value_mask));
+    for (; i + 4 <= n; i += 4) {
+      __m128i r = _mm_loadu_si128(reinterpret_cast<const __m128i*>(regs + i));
+      r = _mm_and_si128(_mm_srli_epi32(r, field::shift), mask);
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(values + i), r);
+    }
+#elif defined(__ARM_NEON)
+    typedef typename reg::field field;
+    const uint32x4_t mask = vdupq_n_u32(field::value_mask);
+    const int32x4_t shift = vdupq_n_s32(-int(field::shift));
+    for (; i + 4 <= n; i += 4) {
+      uint32x4_t r = vshlq_u32(vld1q_u32(regs + i), shift);
+      vst1q_u32(values + i, vandq_u32(r, mask));
+    }
+#endif
+    extract_scalar<reg>(regs + i, values + i, n - i);
+  }
+
+  template<typename reg>
+  void insert(unsigned* regs, const unsigned* values, std::size_t n) {
+    std::size_t i = 0;
+#if defined(__AVX2__)
+    typedef typename reg::field field;
+    const __m256i value_mask = _mm256_set1_epi32(int(field::value_mask));
+    const __m256i keep = _mm256_set1_epi32(int(field::inverted_mask));
+    for (; i + 8 <= n; i += 8) {
+      __m256i r = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(regs + i));
+      __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(values + i));
+      v = _mm256_slli_epi32(_mm256_and_si256(v, value_mask), field::shift);
+      r = _mm256_or_si256(_mm256_and_si256(r, keep), v);
+      _mm256_storeu_si256(reinterpret_cast<__m256i*>(regs + i), r);
+    }
+#elif defined(__SSE2__)
+    typedef typename reg::field field;
+    const __m128i value_mask = _mm_set1_epi32(int(field::value_mask));
+    const __m128i keep = _mm_set1_epi32(int(field::inverted_mask));
+    for (; i + 4 <= n; i += 4) {
+      __m128i r = _mm_loadu_si128(reinterpret_cast<const __m128i*>(regs + i));
+      __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(values + i));
+      v = _mm_slli_epi32(_mm_and_si128(v, value_mask), field::shift);
+      r = _mm_or_si128(_mm_and_si128(r, keep), v);
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(regs + i), r);
+    }
+#elif defined(__ARM_NEON)
+    typedef typename reg::field field;
+    const uint32x4_t value_mask = vdupq_n_u32(field::value_mask);
+    const uint32x4_t cleared = vdupq_n_u32(field::shifted_mask);
+    const int32x4_t shift = vdupq_n_s32(int(field::shift));
+    for (; i + 4 <= n; i += 4) {
+      uint32x4_t v = vshlq_u32(vandq_u32(vld1q_u32(values + i), value_mask), shift);
+      vst1q_u32(regs + i, vorrq_u32(vbicq_u32(vld1q_u32(regs + i), cleared), v));
+    }
+#endif
+    insert_scalar<reg>(regs + i, values + i, n - i);
+  }
+}
+
+#endif // REGISTER_ACCESS_HPP
@@ -1,27 +1,163 @@
+// A simulated register as bit array.
+//
+// This used to reinterpret_cast std::vector<bool>::data(), which the packed
+// std::vector<bool> specialisation doesn't have, and then wrote to a copy.
+// bit_image_t keeps the bits in 32 bit words instead: every bit is
+// addressable, any aligned slice can be viewed as uint8_t/uint16_t/uint32_t
+// without copying, bits are iterated a word at a time with popcount/ctz and
+// the words can back the simulated register file of register_access.
+
+#include "register_access.hpp"
+
 #include <iostream>
 #include <vector>
 #include <algorithm>
 #include <cstdint>
+#include <cstddef>
+#include <cassert>
+#include <type_traits>
 
+class bit_image_t {
+public:
+  typedef unsigned word_t;
+  static const std::size_t word_bits = 32;
+  static_assert(sizeof(word_t) * 8 == word_bits, "32 bit words");
 
+  /**
+   * Typed view of the bits [bit, bit + bits of T), a proxy reading and
+   * writing them in place in their word
+   */
+  template<typename T>
+  class view_t {
+  public:
+    static const unsigned bits = 8 * sizeof(T);
+    static const word_t mask = bits == word_bits ? ~word_t(0) : (word_t(1) << bits) - 1;
 
-int main() {
-  // todo: example not working yet
-  std::vector<bool> simulated_register(1024);
-  std::fill(simulated_register.begin(), simulated_register.end(), false);
+    view_t(word_t* word, unsigned shift) : _word(word), _shift(shift) {}
+    operator T() const {
+      return T((*_word >> _shift) & mask);
+    }
+    view_t& operator=(T value) {
+      *_word = (*_word & ~(mask << _shift)) | ((word_t(value) & mask) << _shift);
+      return *this;
+    }
 
-  std::uint16_t myreg = reinterpret_cast<std::uint16_t&>(simulated_register.data());
-  myreg = 0xff;
+  private:
+    word_t* _word;
+    unsigned _shift;
+  };
+
+  explicit bit_image_t(std::size_t bits)
+    : _bits(bits), _words((bits + word_bits - 1) / word_bits, 0) {}
+
+  std::size_t size() const { return _bits; }
+
+  bool test(std::size_t bit) const {
+    assert(bit < _bits);
+    return (_words[bit / word_bits] >> (bit % word_bits)) & 1;
+  }
 
-  std::vector<bool>::iterator iter = simulated_register.begin();
-  while (iter != simulated_register.end()) {
-    ++iter;
-    if (*iter) {
-      std::cout << 1;
+  void set(std::size_t bit, bool value = true) {
+    assert(bit < _bits);
+    word_t mask = word_t(1) << (bit % word_bits);
+    if (value) {
+      _words[bit / word_bits] |= mask;
     } else {
-      std::cout << 0;
+      _words[bit / word_bits] &= ~mask;
+    }
+  }
+
+  void fill(bool value) {
+    std::fill(_words.begin(), _words.end(), value ? ~word_t(0) : 0);
+    trim();
+  }
+
+  /** view of the slice at bit, which has to be aligned to the size of T */
+  template<typename T>
+  view_t<T> view(std::size_t bit) {
+    static_assert(std::is_unsigned<T>::value && sizeof(T) <= sizeof(word_t),
+                  "unsigned views of up to a word");
+    assert(bit % view_t<T>::bits == 0 && bit + view_t<T>::bits <= _bits);
+    return view_t<T>(&_words[bit / word_bits], unsigned(bit % word_bits));
+  }
+
+  /** the word of the word aligned 32 bit slice at bit, usable as register */
+  word_t* word(std::size_t bit) {
+    assert(bit % word_bits == 0 && bit + word_bits <= _bits);
+    return &_words[bit / word_bits];
+  }
+
+  /** number of set bits */
+  std::size_t count() const {
+    std::size_t n = 0;
+    for (std::size_t i = 0; i < _words.size(); ++i) {
+      n += __builtin_popcount(_words[i]);
+    }
+    return n;
+  }
+
+  /** calls f(bit) for every set bit, ascending, skipping empty words */
+  template<typename F>
+  void for_each_set(F f) const {
+    for (std::size_t i = 0; i < _words.size(); ++i) {
+      for (word_t word = _words[i]; word; word &= word - 1) {
+        f(i * word_bits + __builtin_ctz(word));
+      }
+    }
+  }
+
+  /** the words themselves, e.g. to back the simulated register file */
+  word_t* data() { return _words.data(); }
+  std::size_t word_count() const { return _words.size(); }
+
+private:
+  /** keeps the bits past size() cleared */
+  void trim() {
+    if (_bits % word_bits) {
+      _words.back() &= (word_t(1) << (_bits % word_bits)) - 1;
     }
   }
+
+  std::size_t _bits;
+  std::vector<word_t> _words;
+};
+
+void print(const bit_image_t& image) {
+  for (std::size_t bit = 0; bit < image.size(); ++bit) {
+    std::cout << (image.test(bit) ? 1 : 0);
+  }
+  std::cout << std::endl;
+}
+
+constexpr unsigned long image_base = 0x40000000;
+
+int main() {
+  bit_image_t simulated_register(1024);
+  simulated_register.fill(false);
+
+  bit_image_t::view_t<std::uint16_t> myreg = simulated_register.view<std::uint16_t>(0);
+  myreg = 0xff;
+  print(simulated_register);
+
+  std::cout << simulated_register.count() << " bits set:";
+  simulated_register.for_each_set([](std::size_t bit) { std::cout << " " << bit; });
+  std::cout << std::endl;
+
+  // the image as backing store of simulated registers: register n at
+  // image_base + 4 * n is bits [32 * n, 32 * n + 32) of the image
+  register_file_t::instance().attach(image_base, simulated_register.data(),
+                                     simulated_register.word_count());
+  typedef reg_t<image_base + 4, 0xff, 8, sim_t<rw_t> > field;
+  field::write(0xab);
+  std::cout << "register 1 field: 0x" << std::hex << field::read()
+            << ", image bits 32..47: 0x" << simulated_register.view<std::uint16_t>(32)
+            << std::dec << std::endl;
+
+  // a plain unsigned* into the image, as the old reinterpret_cast intended
+  volatile unsigned* reg2 = simulated_register.word(64);
+  *reg2 = 0x80000001;
+  std::cout << simulated_register.count() << " bits set:";
+  simulated_register.for_each_set([](std::size_t bit) { std::cout << " " << bit; });
   std::cout << std::endl;
   return 0;
 }
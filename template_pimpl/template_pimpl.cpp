@@ -1,12 +1,66 @@
 #include <iostream>
 #include <string>
+#include <vector>
+#include <cstddef>
+#include <memory>
+
+#include "bench.hpp"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define TEMPLATE_PIMPL_X86 1
+#include <immintrin.h>
+#endif
 
 struct HelloImpl {
+  static const char* name() { return "scalar"; }
+  static bool supported() { return true; }
   static void sayHello() {
     std::cout << "Hello" << std::endl;
   }
+  static float sum(const float* values, std::size_t n) {
+    float total = 0;
+    for (std::size_t i = 0; i < n; ++i) {
+      total += values[i];
+    }
+    return total;
+  }
 };
 
+#ifdef TEMPLATE_PIMPL_X86
+/**
+ * Same interface, built for AVX2 whatever the compiler flags say. Only to be
+ * used where supported() is true.
+ */
+struct HelloAvx2Impl {
+  static const char* name() { return "avx2"; }
+  static bool supported() {
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+  }
+  static void sayHello() {
+    std::cout << "Hello from AVX2" << std::endl;
+  }
+  __attribute__((target("avx2")))
+  static float sum(const float* values, std::size_t n) {
+    __m256 totals = _mm256_setzero_ps();
+    std::size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+      totals = _mm256_add_ps(totals, _mm256_loadu_ps(values + i));
+    }
+    float lanes[8];
+    _mm256_storeu_ps(lanes, totals);
+    float total = 0;
+    for (float lane : lanes) {
+      total += lane;
+    }
+    for (; i < n; ++i) {
+      total += values[i];
+    }
+    return total;
+  }
+};
+#endif
+
 template<typename Impl>
 class Hello {
 public:
@@ -15,9 +69,127 @@ public:
   }
 };
 
-int main() {
+template<typename Impl>
+class Sum {
+public:
+  float operator()(const float* values, std::size_t n) {
+    return Impl::sum(values, n);
+  }
+};
+
+/**
+ * Multi-versioning: an entry point Entry<Impl>::run is instantiated for
+ * every implementation and one of them is picked once, at load time. Behind
+ * the entry point everything is bound statically to Impl as before, only the
+ * entry costs an indirect call, so it should wrap a whole hot loop rather
+ * than a single call.
+ *
+ * select returns the entry of the first supported implementation, the last
+ * one is the fallback and has to be supported everywhere.
+ */
+template<template<typename> class Entry, typename Impl, typename... Impls>
+auto select() -> decltype(&Entry<Impl>::run) {
+  if constexpr (sizeof...(Impls) == 0) {
+    return &Entry<Impl>::run;
+  } else {
+    return Impl::supported() ? &Entry<Impl>::run : select<Entry, Impls...>();
+  }
+}
+
+/** the implementations best first, for select */
+template<template<typename> class Entry>
+auto selectBest() -> decltype(&Entry<HelloImpl>::run) {
+#ifdef TEMPLATE_PIMPL_X86
+  return select<Entry, HelloAvx2Impl, HelloImpl>();
+#else
+  return select<Entry, HelloImpl>();
+#endif
+}
+
+template<typename Impl>
+struct HelloEntry {
+  static const char* run() {
+    Hello<Impl> hello;
+    hello();
+    return Impl::name();
+  }
+};
+
+template<typename Impl>
+struct SumEntry {
+  static float run(const float* values, std::size_t n) {
+    Sum<Impl> sum;
+    return sum(values, n);
+  }
+};
+
+// resolved once during static initialisation
+static const auto sayHello = selectBest<HelloEntry>();
+static const auto sum = selectBest<SumEntry>();
+
+#if defined(TEMPLATE_PIMPL_X86) && defined(__ELF__)
+// The same through an ifunc: the dynamic loader calls the resolver once and
+// binds sumResolved to its result, calls are then plain calls through the PLT.
+extern "C" {
+  static float (*resolveSum())(const float*, std::size_t) {
+    return selectBest<SumEntry>();
+  }
+  float sumResolved(const float* values, std::size_t n) __attribute__((ifunc("resolveSum")));
+}
+#endif
+
+/** what the static policy saves, for the benchmark */
+struct VirtualSum {
+  virtual ~VirtualSum() {}
+  virtual float operator()(const float* values, std::size_t n) = 0;
+};
+
+template<typename Impl>
+struct VirtualSumImpl : VirtualSum {
+  float operator()(const float* values, std::size_t n) override {
+    return Impl::sum(values, n);
+  }
+};
+
+/** n sums of 16 floats through each way to reach the implementation */
+void benchmark() {
+  const std::size_t n = 10000000;
+  std::vector<float> values(32, 0.25f);
+  auto run = [&values](const char* name, auto call) {
+    float total = 0;
+    bench::result r = bench::run("template_pimpl", name, n, [&]() {
+      for (std::size_t i = 0; i < n; ++i) {
+        total += call(values.data() + (i & 15), 16);
+      }
+    });
+    std::cout << name << ": " << r.ns_per_op() << " ns/call, total " << total << std::endl;
+  };
+  Sum<HelloImpl> direct;
+  run("static Sum<HelloImpl>  ", direct);
+  std::unique_ptr<VirtualSum> virtualSum(new VirtualSumImpl<HelloImpl>());
+  run("virtual HelloImpl      ", [&virtualSum](const float* v, std::size_t k) { return (*virtualSum)(v, k); });
+  run("selected entry pointer ", sum);
+#if defined(TEMPLATE_PIMPL_X86) && defined(__ELF__)
+  run("ifunc                  ", sumResolved);
+#endif
+}
+
+int main(int argc, char* argv[]) {
+  if (argc > 1 && std::string(argv[1]) == "bench") {
+    benchmark();
+    return 0;
+  }
+
   Hello<HelloImpl> hello;
   hello();
+
+  const char* selected = sayHello();
+  std::cout << "selected: " << selected << std::endl;
+
+  std::vector<float> values(1000, 0.5f);
+  std::cout << "sum: " << sum(values.data(), values.size()) << std::endl;
+#if defined(TEMPLATE_PIMPL_X86) && defined(__ELF__)
+  std::cout << "ifunc sum: " << sumResolved(values.data(), values.size()) << std::endl;
+#endif
   return 0;
 }
-
@@ -2,10 +2,174 @@
 
 #include <iostream>
 #include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+#include <memory>
+#include <algorithm>
+#include <stdexcept>
+#include <chrono>
+#include <cstring>
+#include <cstdint>
+#include <cstddef>
+#include <mutex>
+
+#include "bench.hpp"
 
 
 struct stdstr_tag;
 struct charptr_tag;
+template <std::size_t Capacity> struct inline_tag;
+struct interned_tag;
+struct arena_tag;
+
+/**
+ * Fixed capacity string stored in place: no allocation and copies are a
+ * memcpy, but strings longer than Capacity are rejected.
+ */
+template <std::size_t Capacity>
+class inline_string {
+public:
+    static_assert(Capacity < 256, "the size has to fit a byte");
+
+    inline_string(const char* s) : inline_string(std::string_view(s)) {}
+    inline_string(std::string_view s) : _size(static_cast<unsigned char>(s.size())) {
+        if (s.size() > Capacity) {
+            throw std::length_error("string exceeds inline_string capacity");
+        }
+        std::memcpy(_data, s.data(), s.size());
+        _data[s.size()] = '\0';
+    }
+
+    const char* c_str() const { return _data; }
+    std::size_t size() const { return _size; }
+    operator std::string_view() const { return std::string_view(_data, _size); }
+
+    friend bool operator==(const inline_string& a, const inline_string& b) {
+        return a._size == b._size && std::memcmp(a._data, b._data, a._size) == 0;
+    }
+
+private:
+    unsigned char _size;
+    char _data[Capacity + 1];
+};
+
+/**
+ * Interned string: equal strings share one copy in a process wide pool, so
+ * equality and copies are pointer operations. Construction costs a hash
+ * lookup under the pool's mutex, so atoms can be made from any thread, the
+ * pool never shrinks.
+ */
+class atom {
+public:
+    atom(const char* s) : atom(std::string_view(s)) {}
+    atom(std::string_view s) : _string(intern(s)) {}
+
+    const char* c_str() const { return _string->c_str(); }
+    std::size_t size() const { return _string->size(); }
+    operator std::string_view() const { return *_string; }
+
+    friend bool operator==(const atom& a, const atom& b) {
+        return a._string == b._string;
+    }
+
+private:
+    /** keyed by views of the pooled strings, a hit doesn't allocate */
+    static const std::string* intern(std::string_view s) {
+        static std::mutex m;
+        static std::unordered_map<std::string_view, std::unique_ptr<std::string> > pool;
+        std::lock_guard<std::mutex> lock(m);
+        auto found = pool.find(s);
+        if (found != pool.end()) {
+            return found->second.get();
+        }
+        std::unique_ptr<std::string> string(new std::string(s));
+        std::string_view key = *string;
+        return pool.emplace(key, std::move(string)).first->second.get();
+    }
+
+    const std::string* _string;
+};
+
+/**
+ * Bump allocator for strings: copies go into blocks that are all released
+ * together by clear() or with the arena.
+ */
+class string_arena {
+public:
+    static constexpr std::size_t block_size = 64 * 1024;
+
+    string_arena() : _next(nullptr), _left(0) {}
+
+    /** copy of s, nul terminated */
+    const char* copy(std::string_view s) {
+        if (_left < s.size() + 1) {
+            std::size_t size = std::max(block_size, s.size() + 1);
+            _blocks.emplace_back(new char[size]);
+            _next = _blocks.back().get();
+            _left = size;
+        }
+        char* copy = _next;
+        std::memcpy(copy, s.data(), s.size());
+        copy[s.size()] = '\0';
+        _next += s.size() + 1;
+        _left -= s.size() + 1;
+        return copy;
+    }
+
+    void clear() {
+        _blocks.clear();
+        _next = nullptr;
+        _left = 0;
+    }
+
+    /** arena arena_strings are allocated in, one per thread */
+    static string_arena& current() {
+        thread_local string_arena arena;
+        return arena;
+    }
+
+private:
+    std::vector<std::unique_ptr<char[]> > _blocks;
+    char* _next;
+    std::size_t _left;
+};
+
+/**
+ * String copied into string_arena::current(): allocating is a pointer bump,
+ * copies share the arena copy. Valid until the arena is cleared.
+ */
+class arena_string {
+public:
+    arena_string(const char* s) : arena_string(std::string_view(s)) {}
+    arena_string(std::string_view s)
+        : _data(string_arena::current().copy(s)), _size(s.size()) {}
+
+    const char* c_str() const { return _data; }
+    std::size_t size() const { return _size; }
+    operator std::string_view() const { return std::string_view(_data, _size); }
+
+    friend bool operator==(const arena_string& a, const arena_string& b) {
+        return a._size == b._size && (a._data == b._data || std::memcmp(a._data, b._data, a._size) == 0);
+    }
+
+private:
+    const char* _data;
+    std::size_t _size;
+};
+
+template <std::size_t Capacity>
+std::ostream& operator<<(std::ostream& out, const inline_string<Capacity>& s) {
+    return out << std::string_view(s);
+}
+
+std::ostream& operator<<(std::ostream& out, const atom& s) {
+    return out << std::string_view(s);
+}
+
+std::ostream& operator<<(std::ostream& out, const arena_string& s) {
+    return out << std::string_view(s);
+}
 
 template <class Tag>
 struct string {
@@ -22,12 +186,115 @@ struct string<charptr_tag> {
     typedef const char* type;
 };
 
-int main() {
+template <std::size_t Capacity>
+struct string<inline_tag<Capacity> > {
+    typedef inline_string<Capacity> type;
+};
+
+template <>
+struct string<interned_tag> {
+    typedef atom type;
+};
+
+template <>
+struct string<arena_tag> {
+    typedef arena_string type;
+};
+
+/**
+ * Client code written once against string<Tag>, the fields of the Message
+ * of directives.cpp.
+ */
+template <class Tag>
+struct message {
+    typename string<Tag>::type destination;
+    typename string<Tag>::type source;
+    std::uint64_t id;
+    message(const char* dest, const char* src, std::uint64_t i)
+        : destination(dest), source(src), id(i) {}
+};
+
+/** equal contents, which for const char* isn't what == compares */
+template <class String>
+bool same(const String& a, const String& b) {
+    return a == b;
+}
+
+bool same(const char* a, const char* b) {
+    return std::strcmp(a, b) == 0;
+}
+
+template <class F>
+double ns_per_message(const char* name, const char* operation, std::size_t n, F f) {
+    return bench::run("template_tags", std::string(name) + " " + operation, double(n), f).ns_per_op();
+}
+
+/**
+ * Constructs n message<Tag> from names, copies them and compares copies
+ * with other messages, prints ns per message of each and returns the
+ * number of equal destinations, which has to be the same for every tag.
+ */
+template <class Tag>
+std::size_t benchmark_tag(const char* name, const std::vector<std::string>& names, std::size_t n) {
+    std::vector<message<Tag> > messages;
+    messages.reserve(n);
+    double construct = ns_per_message(name, "construct", n, [&]() {
+        for (std::size_t i = 0; i < n; ++i) {
+            messages.emplace_back(names[i % names.size()].c_str(),
+                                  names[(i * 7) % names.size()].c_str(), i);
+        }
+    });
+    std::vector<message<Tag> > copies;
+    copies.reserve(n);
+    double copy = ns_per_message(name, "copy", n, [&]() {
+        copies.assign(messages.begin(), messages.end());
+    });
+    std::size_t equal = 0;
+    double compare = ns_per_message(name, "compare", n, [&]() {
+        for (std::size_t i = 0; i + 1 < n; ++i) {
+            equal += same(copies[i].destination, messages[(i * 13) % n].destination);
+        }
+    });
+    std::cout << name << ": construct " << construct << ", copy " << copy
+              << ", compare " << compare << " ns/message" << std::endl;
+    string_arena::current().clear();
+    return equal;
+}
+
+int benchmark() {
+    const std::size_t n = 1000000;
+    // short names fit the std::string small buffer, long ones don't
+    std::vector<std::string> names;
+    for (unsigned i = 0; i < 61; ++i) {
+        names.push_back(i % 2 ? "host" + std::to_string(i)
+                              : "service.endpoint.number." + std::to_string(i));
+    }
+    std::size_t expected = benchmark_tag<stdstr_tag>("std::string  ", names, n);
+    bool ok = true;
+    ok &= benchmark_tag<charptr_tag>("const char*  ", names, n) == expected;
+    ok &= benchmark_tag<inline_tag<31> >("inline_string", names, n) == expected;
+    ok &= benchmark_tag<interned_tag>("atom         ", names, n) == expected;
+    ok &= benchmark_tag<arena_tag>("arena_string ", names, n) == expected;
+    std::cout << expected << " equal destinations" << (ok ? "" : " MISMATCH") << std::endl;
+    return ok ? 0 : 1;
+}
+
+int main(int argc, char* argv[]) {
+    if (argc > 1 && std::string(argv[1]) == "bench") {
+        return benchmark();
+    }
+
     string<stdstr_tag>::type  str1 = "str1";
     string<charptr_tag>::type str2 = "str2";
 
     std::cout << str1 << " " << str2 << std::endl;
 
+    string<inline_tag<15> >::type str3 = "str3";
+    string<interned_tag>::type    str4 = "str4";
+    string<arena_tag>::type       str5 = "str5";
+
+    std::cout << str3 << " " << str4 << " " << str5 << std::endl;
+    std::cout << "interned equal: " << (str4 == string<interned_tag>::type("str4")) << std::endl;
+
     return 0;
 }
-
@@ -3,6 +3,17 @@
 #include <iostream>
 #include <memory>
 #include <vector>
+#include <string>
+#include <string_view>
+#include <bitset>
+#include <type_traits>
+#include <utility>
+#include <cstddef>
+#include <chrono>
+#include <unordered_map>
+#include <memory_resource>
+
+#include "bench.hpp"
 
 struct Weapon {
    bool can_attack() const { return true; } // All weapons can do damage
@@ -33,39 +44,504 @@ struct PoisonPotion {
    bool can_attack() const { return true; }
 };
 
+/**
+ * Compile time type identity and name
+ * type_id<T>() is unique per type and a constant expression, type_name<T>()
+ * views the type's name inside the compiler generated function signature,
+ * i.e. static storage: no RTTI, no allocation, no mangling.
+ */
+typedef const void* type_id_t;
+
+template< typename T > struct type_tag {
+   static constexpr char id = 0;
+};
+
+template< typename T > constexpr type_id_t type_id()
+   { return &type_tag< T >::id; }
+
+template< typename T > constexpr std::string_view type_name() {
+   // "... [with T = Weapon; ...]" (gcc) or "... [T = Weapon]" (clang)
+   std::string_view signature = __PRETTY_FUNCTION__;
+   std::size_t begin = signature.find( "T = " ) + 4;
+   return signature.substr( begin, signature.find_first_of( ";]", begin ) - begin );
+}
 
+/**
+ * Traits of an item, cached by CachedTraitsObject at construction: queries
+ * against them are a bit test without virtual call
+ */
+enum trait {
+   attack_trait,
+   trait_count
+};
+typedef std::bitset< trait_count > traits_t;
+
+template< typename T > traits_t traits_of( const T& t ) {
+   traits_t traits;
+   traits.set( attack_trait, t.can_attack() );
+   return traits;
+}
+
+/**
+ * Type erased object with value semantics
+ * Models small enough for the inline buffer (and nothrow movable) are stored
+ * right inside the Object, without heap allocation. Larger ones are
+ * allocated from a std::pmr::memory_resource, the default resource unless
+ * one is given; the unused buffer then remembers the resource to give the
+ * memory back to. Build a whole backpack into a monotonic arena and it is
+ * freed in one shot. Copies clone the model, by default into the default
+ * resource like std::pmr containers do, moves steal it, nothing is shared
+ * or refcounted. Queries are virtual calls into the model, see
+ * CachedTraitsObject for answering them without.
+ */
 class Object {
+   static const std::size_t inline_size = 4 * sizeof(void*);
+   typedef std::aligned_storage<inline_size, alignof(std::max_align_t)>::type Storage;
+   typedef std::pmr::memory_resource Resource;
+
    struct ObjectConcept {
        virtual ~ObjectConcept() {}
        virtual bool has_attack_concept() const = 0;
-       virtual std::string name() const = 0;
+       virtual std::string_view name() const = 0;
+       /** copy into buffer if it fits there, else into resource */
+       virtual ObjectConcept* clone( Storage* buffer, Resource* resource ) const = 0;
+       /** move into buffer, only called for models stored inline */
+       virtual ObjectConcept* move( Storage* buffer ) = 0;
+       /** destroy, and give the memory back to resource unless inline */
+       virtual void destroy( Resource* resource ) = 0;
    };
 
    template< typename T > struct ObjectModel : ObjectConcept {
        ObjectModel( const T& t ) : object( t ) {}
+       ObjectModel( T&& t ) : object( std::move( t ) ) {}
        virtual ~ObjectModel() {}
        virtual bool has_attack_concept() const
            { return object.can_attack(); }
-       virtual std::string name() const
-           { return typeid(object).name(); }
+       virtual std::string_view name() const
+           { return type_name< T >(); }
+       virtual ObjectConcept* clone( Storage* buffer, Resource* resource ) const
+           { return create( buffer, resource, object ); }
+       virtual ObjectConcept* move( Storage* buffer )
+           { return new( buffer ) ObjectModel( std::move( object ) ); }
+       virtual void destroy( Resource* resource ) {
+           this->~ObjectModel();
+           if( resource )
+               resource->deallocate( this, sizeof( ObjectModel ), alignof( ObjectModel ) );
+       }
+
+       template< typename U >
+       static ObjectConcept* create( Storage* buffer, Resource* resource, U&& u ) {
+           if( sizeof( ObjectModel ) <= inline_size &&
+               alignof( ObjectModel ) <= alignof( Storage ) &&
+               std::is_nothrow_move_constructible< T >::value )
+               return new( buffer ) ObjectModel( std::forward< U >( u ) );
+           void* memory = resource->allocate( sizeof( ObjectModel ), alignof( ObjectModel ) );
+           try {
+               ObjectConcept* model = new( memory ) ObjectModel( std::forward< U >( u ) );
+               *reinterpret_cast< Resource** >( buffer ) = resource;
+               return model;
+           } catch( ... ) {
+               resource->deallocate( memory, sizeof( ObjectModel ), alignof( ObjectModel ) );
+               throw;
+           }
+       }
      private:
        T object;
    };
 
-   std::shared_ptr<ObjectConcept> object;
+   bool is_inline() const
+      { return static_cast< const void* >( object ) == &buffer; }
+
+   /** the resource a heap stored model came from */
+   Resource* heap_resource() const
+      { return *reinterpret_cast< Resource* const* >( &buffer ); }
+
+   void reset() {
+      object->destroy( is_inline() ? nullptr : heap_resource() );
+      object = nullptr;
+   }
+
+   /** takes over other's model, leaves other empty */
+   void steal( Object& other ) {
+      if( other.is_inline() ) {
+          object = other.object->move( &buffer );
+          other.reset();
+      } else {
+          object = other.object;
+          *reinterpret_cast< Resource** >( &buffer ) = other.heap_resource();
+          other.object = nullptr;
+      }
+   }
+
+   ObjectConcept* object;
+   Storage buffer;
 
   public:
-   template< typename T > Object( const T& obj ) :
-      object( new ObjectModel<T>( obj ) ) {}
+   template< typename T >
+   Object( const T& obj, Resource* resource = std::pmr::get_default_resource() ) :
+      object( ObjectModel<T>::create( &buffer, resource, obj ) ) {}
+
+   Object( const Object& other, Resource* resource = std::pmr::get_default_resource() ) :
+      object( other.object ? other.object->clone( &buffer, resource ) : nullptr ) {}
 
-   std::string name() const
+   Object( Object&& other ) noexcept : object( nullptr )
+      { steal( other ); }
+
+   Object& operator=( const Object& other ) {
+      if( this != &other ) {
+          Object copy( other );
+          *this = std::move( copy );
+      }
+      return *this;
+   }
+
+   Object& operator=( Object&& other ) noexcept {
+      if( this != &other ) {
+          if( object )
+              reset();
+          steal( other );
+      }
+      return *this;
+   }
+
+   ~Object()
+      { if( object ) reset(); }
+
+   std::string_view name() const
       { return object->name(); }
 
    bool has_attack_concept() const
       { return object->has_attack_concept(); }
 };
 
-int main() {
+/**
+ * Object with the item's traits cached next to it
+ * Opt in where the same queries run over and over: they become a bit test
+ * on the element itself instead of a virtual call, for a few bytes more per
+ * item. Everything else is forwarded to the Object.
+ */
+class CachedTraitsObject {
+   typedef std::pmr::memory_resource Resource;
+
+   Object object;
+   traits_t traits;
+
+  public:
+   template< typename T >
+   CachedTraitsObject( const T& obj, Resource* resource = std::pmr::get_default_resource() ) :
+      object( obj, resource ), traits( traits_of( obj ) ) {}
+
+   std::string_view name() const
+      { return object.name(); }
+
+   bool has_trait( trait t ) const
+      { return traits.test( t ); }
+
+   bool has_attack_concept() const
+      { return has_trait( attack_trait ); }
+};
+
+/**
+ * Type erased object without virtual functions
+ * Same value semantics as Object, but instead of a model class with virtual
+ * functions every erased type gets one static table of function pointers.
+ * The Object holds a pointer to that table next to the inline storage, so a
+ * call loads the table pointer from the element itself and jumps, without
+ * going through the model's vptr first. Heap stored models keep their pointer
+ * in the storage, whether a type is inline is a compile time property its
+ * table functions know about.
+ */
+class VtableObject {
+   static const std::size_t inline_size = 3 * sizeof(void*);
+   typedef std::aligned_storage<inline_size, alignof(void*)>::type Storage;
+
+   struct Vtable {
+       bool (*has_attack_concept)( const Storage& );
+       std::string_view (*name)( const Storage& );
+       void (*copy)( Storage& to, const Storage& from );
+       void (*move)( Storage& to, Storage& from ); // leaves from destroyed
+       void (*destroy)( Storage& );
+   };
+
+   template< typename T > struct Model {
+       static const bool fits_inline =
+           sizeof( T ) <= sizeof( Storage ) &&
+           alignof( T ) <= alignof( Storage ) &&
+           std::is_nothrow_move_constructible< T >::value;
+
+       static const T& get( const Storage& s ) {
+           return fits_inline ? *reinterpret_cast< const T* >( &s )
+                              : **reinterpret_cast< T* const* >( &s );
+       }
+       template< typename U > static void create( Storage& s, U&& u ) {
+           if( fits_inline )
+               new( &s ) T( std::forward< U >( u ) );
+           else
+               *reinterpret_cast< T** >( &s ) = new T( std::forward< U >( u ) );
+       }
+       static bool has_attack_concept( const Storage& s )
+           { return get( s ).can_attack(); }
+       static std::string_view name( const Storage& )
+           { return type_name< T >(); }
+       static void copy( Storage& to, const Storage& from )
+           { create( to, get( from ) ); }
+       static void move( Storage& to, Storage& from ) {
+           if( fits_inline ) {
+               T& object = *reinterpret_cast< T* >( &from );
+               new( &to ) T( std::move( object ) );
+               object.~T();
+           } else {
+               to = from;
+           }
+       }
+       static void destroy( Storage& s ) {
+           if( fits_inline )
+               reinterpret_cast< T* >( &s )->~T();
+           else
+               delete *reinterpret_cast< T** >( &s );
+       }
+       static const Vtable table;
+   };
+
+   const Vtable* vtable;
+   Storage storage;
+
+  public:
+   template< typename T > VtableObject( const T& obj ) : vtable( &Model<T>::table )
+      { Model<T>::create( storage, obj ); }
+
+   VtableObject( const VtableObject& other ) : vtable( other.vtable )
+      { if( vtable ) vtable->copy( storage, other.storage ); }
+
+   VtableObject( VtableObject&& other ) noexcept : vtable( other.vtable ) {
+      if( vtable ) vtable->move( storage, other.storage );
+      other.vtable = nullptr;
+   }
+
+   VtableObject& operator=( const VtableObject& other ) {
+      if( this != &other ) {
+          VtableObject copy( other );
+          *this = std::move( copy );
+      }
+      return *this;
+   }
+
+   VtableObject& operator=( VtableObject&& other ) noexcept {
+      if( this != &other ) {
+          if( vtable ) vtable->destroy( storage );
+          vtable = other.vtable;
+          if( vtable ) vtable->move( storage, other.storage );
+          other.vtable = nullptr;
+      }
+      return *this;
+   }
+
+   ~VtableObject()
+      { if( vtable ) vtable->destroy( storage ); }
+
+   std::string_view name() const
+      { return vtable->name( storage ); }
+
+   bool has_attack_concept() const
+      { return vtable->has_attack_concept( storage ); }
+};
+
+template< typename T > const VtableObject::Vtable VtableObject::Model<T>::table = {
+   &VtableObject::Model<T>::has_attack_concept,
+   &VtableObject::Model<T>::name,
+   &VtableObject::Model<T>::copy,
+   &VtableObject::Model<T>::move,
+   &VtableObject::Model<T>::destroy
+};
+
+/**
+ * Type partitioned backpack
+ * Instead of one sequence of erased objects, every concrete item type gets
+ * its own contiguous segment, created on first insertion of that type.
+ * Dispatch happens once per segment, inside a segment the loop runs over a
+ * dense std::vector<T> with the type statically known, so can_attack() is
+ * inlined. Items of one type keep their insertion order, order across types
+ * is the order the segments were created in.
+ */
+class PolyBackpack {
+   struct SegmentConcept {
+       virtual ~SegmentConcept() {}
+       virtual std::size_t size() const = 0;
+       virtual std::size_t footprint() const = 0;
+       virtual std::size_t count_attack() const = 0;
+       virtual std::string_view name() const = 0;
+   };
+
+   template< typename T > struct SegmentModel : SegmentConcept {
+       virtual ~SegmentModel() {}
+       virtual std::size_t size() const
+           { return items.size(); }
+       virtual std::size_t footprint() const
+           { return items.size() * sizeof( T ); }
+       virtual std::size_t count_attack() const {
+           std::size_t n = 0;
+           for( typename std::vector< T >::const_iterator item = items.begin();
+                item != items.end(); ++item )
+               if( item->can_attack() )
+                   ++n;
+           return n;
+       }
+       virtual std::string_view name() const
+           { return type_name< T >(); }
+       std::vector< T > items;
+   };
+
+   template< typename T > SegmentModel< T >& segment_for() {
+       std::unordered_map< type_id_t, SegmentConcept* >::iterator found =
+           index.find( type_id< T >() );
+       if( found != index.end() )
+           return *static_cast< SegmentModel< T >* >( found->second );
+       SegmentModel< T >* segment = new SegmentModel< T >;
+       segments.push_back( std::unique_ptr< SegmentConcept >( segment ) );
+       index[ type_id< T >() ] = segment;
+       return *segment;
+   }
+
+   std::vector< std::unique_ptr< SegmentConcept > > segments;
+   std::unordered_map< type_id_t, SegmentConcept* > index;
+
+  public:
+   template< typename T > void push_back( const T& item )
+      { segment_for< T >().items.push_back( item ); }
+
+   /** the dense segment of one type, for fully static sweeps */
+   template< typename T > const std::vector< T >& segment()
+      { return segment_for< T >().items; }
+
+   std::size_t size() const {
+      std::size_t n = 0;
+      for( std::size_t i = 0; i < segments.size(); ++i )
+          n += segments[i]->size();
+      return n;
+   }
+
+   std::size_t footprint() const {
+      std::size_t n = 0;
+      for( std::size_t i = 0; i < segments.size(); ++i )
+          n += segments[i]->footprint();
+      return n;
+   }
+
+   std::size_t count_attack() const {
+      std::size_t n = 0;
+      for( std::size_t i = 0; i < segments.size(); ++i )
+          n += segments[i]->count_attack();
+      return n;
+   }
+
+   /** calls f( name, count ) for every type holding items one can attack with */
+   template< typename F > void for_each_attack_type( F f ) const {
+      for( std::size_t i = 0; i < segments.size(); ++i ) {
+          std::size_t n = segments[i]->count_attack();
+          if( n )
+              f( segments[i]->name(), n );
+      }
+   }
+};
+
+template< typename Item >
+std::size_t count_attack( const std::vector< Item >& backpack ) {
+   std::size_t n = 0;
+   for( typename std::vector< Item >::const_iterator item = backpack.begin();
+        item != backpack.end(); ++item )
+       if( item->has_attack_concept() )
+           ++n;
+   return n;
+}
+
+std::size_t count_attack( const PolyBackpack& backpack )
+   { return backpack.count_attack(); }
+
+template< typename Item >
+std::size_t footprint( const std::vector< Item >& backpack )
+   { return backpack.size() * sizeof( Item ); }
+
+std::size_t footprint( const PolyBackpack& backpack )
+   { return backpack.footprint(); }
+
+/**
+ * Fills a backpack with n items of pseudo random type and times the "items
+ * I can attack with" filter over it
+ */
+template< typename Backpack >
+void benchmark_backpack( const char* label, std::size_t n ) {
+   Backpack backpack;
+   unsigned seed = 42;
+   for( std::size_t i = 0; i < n; ++i ) {
+       seed = seed * 1103515245u + 12345u;
+       switch( ( seed >> 16 ) % 6 ) {
+           case 0: backpack.push_back( Weapon() ); break;
+           case 1: backpack.push_back( Armor() ); break;
+           case 2: backpack.push_back( Potion() ); break;
+           case 3: backpack.push_back( Scroll() ); break;
+           case 4: backpack.push_back( FireScroll() ); break;
+           default: backpack.push_back( PoisonPotion() ); break;
+       }
+   }
+
+   std::size_t attack = 0;
+   bench::result r = bench::run( "type_erasure", label, n, [&]() {
+       attack = count_attack( backpack );
+   } );
+
+   std::cout << label << ": " << r.ns_per_op() << " ns/item, " << attack << " of " << n << " can attack, "
+             << double( footprint( backpack ) ) / n << " bytes/item" << std::endl;
+}
+
+/** item too big for the inline buffer */
+struct Chest {
+   double contents[8];
+   bool can_attack() const { return false; }
+};
+
+/**
+ * Times building and tearing down a backpack of n heap stored items, from
+ * the global heap versus from a monotonic arena. Returns false unless every
+ * item allocates once from the heap and the arena only takes a few blocks.
+ */
+bool benchmark_arena( std::size_t n ) {
+   bench::result heap = bench::run( "type_erasure", "heap stored items, global heap", n, [n]() {
+       std::vector< Object > backpack;
+       backpack.reserve( n );
+       for( std::size_t i = 0; i < n; ++i )
+           backpack.emplace_back( Chest() );
+   } );
+   bench::result arena = bench::run( "type_erasure", "heap stored items, monotonic arena", n, [n]() {
+       std::pmr::monotonic_buffer_resource arena;
+       std::pmr::vector< Object > backpack( &arena );
+       backpack.reserve( n );
+       for( std::size_t i = 0; i < n; ++i )
+           backpack.emplace_back( Chest(), &arena );
+   } );
+
+   std::cout << "build and free " << n << " heap stored items: global heap "
+             << heap.ns_per_op() << " ns/item, " << heap.allocs_per_op() << " allocs/item, "
+             << "monotonic arena " << arena.ns_per_op() << " ns/item, "
+             << arena.allocs_per_op() << " allocs/item";
+   bool ok = heap.allocs_per_op() >= 1 && heap.allocs_per_op() < 1.01 &&
+             arena.allocs_per_op() < 0.01;
+   std::cout << ( ok ? "" : " ALLOCATION COUNT REGRESSION" ) << std::endl;
+   return ok;
+}
+
+int benchmark( std::size_t n ) {
+   benchmark_backpack< std::vector< Object > >( "virtual Object      ", n );
+   benchmark_backpack< std::vector< CachedTraitsObject > >( "Object, cached trait", n );
+   benchmark_backpack< std::vector< VtableObject > >( "manual vtable Object", n );
+   benchmark_backpack< PolyBackpack >( "type partitioned    ", n );
+   return benchmark_arena( n / 10 ) ? 0 : 1;
+}
+
+int main( int argc, char* argv[] ) {
+   if( argc > 1 && std::string( argv[1] ) == "bench" ) {
+       return benchmark( argc > 2 ? std::stoul( argv[2] ) : 10000000 );
+   }
+
    typedef std::vector< Object >    Backpack;
    typedef Backpack::const_iterator BackpackIter;
 
@@ -82,4 +558,17 @@ int main() {
    for( BackpackIter item = backpack.begin(); item != backpack.end(); ++item )
        if( item->has_attack_concept() )
            std::cout << " *" << item->name() << std::endl;
+
+   PolyBackpack partitioned;
+   partitioned.push_back( Weapon() );
+   partitioned.push_back( Armor() );
+   partitioned.push_back( Potion() );
+   partitioned.push_back( Scroll() );
+   partitioned.push_back( FireScroll() );
+   partitioned.push_back( PoisonPotion() );
+   partitioned.push_back( Weapon() );
+
+   std::cout << "Items I can attack with, by type:" << std::endl;
+   partitioned.for_each_attack_type( []( std::string_view name, std::size_t n )
+       { std::cout << " *" << name << " x" << n << std::endl; } );
 }
@@ -1,6 +1,18 @@
 // http://barendgehrels.blogspot.ch/2010/10/tag-dispatching-by-type-tag-dispatching.html
 
 #include <iostream>
+#include <string>
+#include <variant>
+#include <vector>
+#include <memory>
+#include <algorithm>
+#include <type_traits>
+#include <chrono>
+#include <random>
+#include <cstddef>
+#include <cmath>
+
+#include "bench.hpp"
 
 struct apple_tag {};
 struct banana_tag {};
@@ -11,8 +23,8 @@ struct apple {
     double radius;
     std::string name;
 
-    apple(std::string const& n)
-        : name(n) {
+    apple(std::string const& n, double r = 0.04)
+        : radius(r), name(n) {
     }
 };
 
@@ -20,8 +32,8 @@ struct banana {
     double length;
     std::string name;
 
-    banana(std::string const& n)
-        : name(n) {
+    banana(std::string const& n, double l = 0.18)
+        : length(l), name(n) {
     }
 };
 
@@ -49,6 +61,20 @@ namespace dispatch {
         }
     };
 
+    template <typename Tag> struct weigh {};
+
+    template <> struct weigh<apple_tag> {
+        static double apply(const apple& a) {
+            return 4.0 / 3.0 * 3.14159 * a.radius * a.radius * a.radius * 850.0;
+        }
+    };
+
+    template <> struct weigh<banana_tag> {
+        static double apply(const banana& b) {
+            return b.length * 0.65;
+        }
+    };
+
     template <typename Tag> struct spherical {};
 
     template <> struct spherical<apple_tag> {
@@ -71,7 +97,175 @@ struct spherical {
 };
 
 
-int main() {
+// Fruit of any tagged type, e.g. a stream of apples and bananas.
+typedef std::variant<apple, banana> fruit;
+
+// Jump table over the alternatives of a variant: entry i applies
+// dispatch::Op<tag<T>::type> to alternative i, so a call is one indirect
+// jump through a table generated at compile time, selected by index().
+template <template <typename> class Op, typename Variant> struct dispatch_table;
+
+template <template <typename> class Op, typename... Ts>
+struct dispatch_table<Op, std::variant<Ts...> > {
+    typedef std::variant<Ts...> variant;
+    typedef std::common_type_t<
+        decltype(Op<typename tag<Ts>::type>::apply(std::declval<const Ts&>()))...> result;
+
+    static result apply(const variant& v) {
+        return single[v.index()](v);
+    }
+
+    // Op over a run [first, last) of variants all holding alternative index
+    template <typename F>
+    static void apply_run(std::size_t index, const variant* first, const variant* last, F f) {
+        run<F>()[index](first, last, f);
+    }
+
+private:
+    template <typename T>
+    static result call(const variant& v) {
+        return Op<typename tag<T>::type>::apply(*std::get_if<T>(&v));
+    }
+
+    template <typename F, typename T>
+    static void call_run(const variant* first, const variant* last, F& f) {
+        for (; first != last; ++first) {
+            f(Op<typename tag<T>::type>::apply(*std::get_if<T>(first)));
+        }
+    }
+
+    template <typename F>
+    static auto run() {
+        typedef void (*entry)(const variant*, const variant*, F&);
+        static constexpr entry table[] = {&call_run<F, Ts>...};
+        return table;
+    }
+
+    static constexpr result (*single[])(const variant&) = {&call<Ts>...};
+};
+
+template <template <typename> class Op, typename Variant>
+typename dispatch_table<Op, Variant>::result apply(const Variant& v) {
+    return dispatch_table<Op, Variant>::apply(v);
+}
+
+// Mixed fruit in one vector. for_each calls the jump table per fruit,
+// group() sorts by tag, after which for_each_grouped dispatches once per run
+// of the same fruit and loops over the run with the call inlined.
+class fruit_basket {
+public:
+    void add(const fruit& f) {
+        fruits.push_back(f);
+        grouped = false;
+    }
+    std::size_t size() const { return fruits.size(); }
+
+    template <template <typename> class Op, typename F>
+    void for_each(F f) const {
+        for (const fruit& each : fruits) {
+            f(apply<Op>(each));
+        }
+    }
+
+    void group() {
+        std::stable_sort(fruits.begin(), fruits.end(),
+                         [](const fruit& a, const fruit& b) { return a.index() < b.index(); });
+        grouped = true;
+    }
+
+    template <template <typename> class Op, typename F>
+    void for_each_grouped(F f) {
+        if (!grouped) {
+            group();
+        }
+        const fruit* first = fruits.data();
+        const fruit* end = first + fruits.size();
+        while (first != end) {
+            const fruit* last = first;
+            while (last != end && last->index() == first->index()) {
+                ++last;
+            }
+            dispatch_table<Op, fruit>::apply_run(first->index(), first, last, f);
+            first = last;
+        }
+    }
+
+private:
+    std::vector<fruit> fruits;
+    bool grouped = false;
+};
+
+// What we had before: fruit behind a virtual call.
+struct virtual_fruit {
+    virtual ~virtual_fruit() {}
+    virtual double weigh() const = 0;
+};
+
+template <typename T>
+struct virtual_fruit_t : virtual_fruit {
+    T fruit;
+    explicit virtual_fruit_t(const T& f) : fruit(f) {}
+    double weigh() const override {
+        return dispatch::weigh<typename tag<T>::type>::apply(fruit);
+    }
+};
+
+template <typename F>
+double ns_per_fruit(const char* name, std::size_t n, unsigned rounds, double& total, F f) {
+    total = 0;
+    return bench::run("type_tag_dispatching", name, double(n) * rounds, [&]() {
+        for (unsigned round = 0; round < rounds; ++round) {
+            f(total);
+        }
+    }).ns_per_op();
+}
+
+int benchmark() {
+    const std::size_t n = 1000000;
+    const unsigned rounds = 20;
+    std::mt19937 random(42);
+    fruit_basket basket;
+    std::vector<std::unique_ptr<virtual_fruit> > virtual_basket;
+    for (std::size_t i = 0; i < n; ++i) {
+        double size = 0.01 * (random() % 10);
+        if (random() % 2) {
+            basket.add(apple("apple", 0.03 + size));
+            virtual_basket.emplace_back(new virtual_fruit_t<apple>(apple("apple", 0.03 + size)));
+        } else {
+            basket.add(banana("banana", 0.1 + size));
+            virtual_basket.emplace_back(new virtual_fruit_t<banana>(banana("banana", 0.1 + size)));
+        }
+    }
+
+    double virtual_total, table_total, grouped_total;
+    double virtual_ns = ns_per_fruit("virtual call", n, rounds, virtual_total, [&](double& total) {
+        for (const std::unique_ptr<virtual_fruit>& f : virtual_basket) {
+            total += f->weigh();
+        }
+    });
+    double table_ns = ns_per_fruit("jump table", n, rounds, table_total, [&](double& total) {
+        basket.for_each<dispatch::weigh>([&total](double weight) { total += weight; });
+    });
+    basket.group();
+    double grouped_ns = ns_per_fruit("grouped", n, rounds, grouped_total, [&](double& total) {
+        basket.for_each_grouped<dispatch::weigh>([&total](double weight) { total += weight; });
+    });
+
+    // grouped sums in another order, allow for rounding
+    bool ok = table_total == virtual_total &&
+              std::abs(grouped_total - virtual_total) <= 1e-9 * virtual_total;
+    std::cout << "virtual call: " << virtual_ns << " ns/fruit" << std::endl;
+    std::cout << "jump table  : " << table_ns << " ns/fruit" << std::endl;
+    std::cout << "grouped     : " << grouped_ns << " ns/fruit" << std::endl;
+    std::cout << "total weight: " << virtual_total << (ok ? "" : " MISMATCH") << std::endl;
+    return ok ? 0 : 1;
+}
+
+int main(int argc, char* argv[]) {
+    if (argc > 1 && std::string(argv[1]) == "bench") {
+        return benchmark();
+    }
+
     apple a("my apple");
     banana b("my banana");
 
@@ -81,6 +275,14 @@ int main() {
     std::cout << "is apple spherical: " << spherical<apple>::value << std::endl;
     std::cout << "is banana spherical: " << spherical<banana>::value << std::endl;
 
+    std::vector<fruit> fruits;
+    fruits.push_back(banana("mixed banana"));
+    fruits.push_back(a);
+    fruits.push_back(b);
+    for (const fruit& f : fruits) {
+        apply<dispatch::eat>(f);
+    }
+
     return 0;
 }
 